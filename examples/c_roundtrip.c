@@ -0,0 +1,95 @@
+/*
+ * Example of using libpzpipe's C interface (pzpipe_c.h): compresses a buffer to memory through the write callback, decompresses it back
+ * through the read callback and checks the result. Also built as a test, returns non-zero if anything doesn't behave as documented.
+ */
+#include "pzpipe_c.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+  char* data;
+  size_t size;
+  size_t capacity;
+  size_t read_pos;
+} memory_stream;
+
+static int write_to_memory(void* opaque, const void* data, size_t size) {
+  memory_stream* stream = (memory_stream*)opaque;
+  if (stream->size + size > stream->capacity) {
+    const size_t new_capacity = (stream->size + size) * 2;
+    char* new_data = (char*)realloc(stream->data, new_capacity);
+    if (new_data == NULL) return -1;
+    stream->data = new_data;
+    stream->capacity = new_capacity;
+  }
+  memcpy(stream->data + stream->size, data, size);
+  stream->size += size;
+  return 0;
+}
+
+static long long read_from_memory(void* opaque, void* buf, size_t size) {
+  memory_stream* stream = (memory_stream*)opaque;
+  const size_t left = stream->size - stream->read_pos;
+  const size_t amt = size < left ? size : left;
+  memcpy(buf, stream->data + stream->read_pos, amt);
+  stream->read_pos += amt;
+  return (long long)amt;
+}
+
+static int fail(const char* what, const char* error) {
+  fprintf(stderr, "FAILED: %s%s%s\n", what, error != NULL ? ": " : "", error != NULL ? error : "");
+  return 1;
+}
+
+int main(void) {
+  /* Some compressible data, a bit over three 64KB chunks so the stream has several blocks */
+  const size_t input_size = 200000;
+  char* input = (char*)malloc(input_size);
+  char* output = (char*)malloc(input_size + 7777);  /* room for a read past the end if the stream decompresses to too much */
+  memory_stream compressed = { NULL, 0, 0, 0 };
+  size_t i;
+  long long amt_read;
+  long long total_read = 0;
+  for (i = 0; i < input_size; i++) input[i] = "pzpipe example "[(i * i / 7) % 15];
+
+  /* Threads shared by every context created on the pool */
+  pzpipe_pool* pool = pzpipe_pool_create(0, 0);
+  if (pool == NULL) return fail("pzpipe_pool_create", NULL);
+
+  /* Invalid arguments get NULL back instead of a context */
+  if (pzpipe_compressor_create(pool, 0, "q", write_to_memory, &compressed) != NULL) return fail("invalid method accepted", NULL);
+  if (pzpipe_compressor_create(pool, 1 << 20, "x0,3ci1", write_to_memory, &compressed) != NULL) return fail("too small method block size accepted", NULL);
+  if (pzpipe_compressor_create(pool, 1000, NULL, write_to_memory, &compressed) != NULL) return fail("invalid chunk size accepted", NULL);
+
+  pzpipe_compressor* compressor = pzpipe_compressor_create(pool, 1 << 16, NULL, write_to_memory, &compressed);
+  if (compressor == NULL) return fail("pzpipe_compressor_create", NULL);
+  /* Data can be fed in pieces of any size */
+  for (i = 0; i < input_size; i += 10000) {
+    if (pzpipe_compressor_feed(compressor, input + i, input_size - i < 10000 ? input_size - i : 10000) != 0) {
+      return fail("pzpipe_compressor_feed", pzpipe_compressor_error(compressor));
+    }
+  }
+  if (pzpipe_compressor_finish(compressor) != 0) return fail("pzpipe_compressor_finish", pzpipe_compressor_error(compressor));
+  pzpipe_compressor_free(compressor);
+
+  pzpipe_decompressor* decompressor = pzpipe_decompressor_create(pool, read_from_memory, &compressed);
+  if (decompressor == NULL) return fail("pzpipe_decompressor_create", NULL);
+  while ((amt_read = pzpipe_decompressor_read(decompressor, output + total_read, 7777)) > 0) {
+    total_read += amt_read;
+    if (total_read > (long long)input_size) return fail("decompressed more than was compressed", NULL);
+  }
+  if (amt_read < 0) return fail("pzpipe_decompressor_read", pzpipe_decompressor_error(decompressor));
+  pzpipe_decompressor_free(decompressor);
+  pzpipe_pool_free(pool);
+
+  if (total_read != (long long)input_size || memcmp(input, output, input_size) != 0) return fail("decompressed data differs", NULL);
+  printf("%zu bytes compressed to %zu and back\n", input_size, compressed.size);
+
+  free(compressed.data);
+  free(output);
+  free(input);
+  return 0;
+}
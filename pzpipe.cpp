@@ -15,7 +15,7 @@
 // version information
 #define V_MAJOR 0
 #define V_MINOR 2
-static constexpr char V_MINOR2 = 'a';
+static constexpr char V_MINOR2 = 'c';
 //#define V_STATE "ALPHA"
 #define V_STATE "DEVELOPMENT"
 //#define V_MSG "USE FOR TESTING ONLY"
@@ -66,6 +66,8 @@ static constexpr char V_MINOR2 = 'a';
 #define PATH_DELIM '/'
 #endif
 
+#include <atomic>
+#include <mutex>
 #include <thread>
 #include <cstdio>
 #include <vector>
@@ -85,7 +87,9 @@ static constexpr char V_MINOR2 = 'a';
 # define SET_BINARY_MODE(handle) ((void)0)
 #endif
 
+#include "pzpipe_utils.h"
 #include "pzpipe_io.h"
+#include "pzpipe_async_io.h"
 
 #define P_COMPRESS 1
 #define P_DECOMPRESS 2
@@ -97,12 +101,30 @@ public:
     }
 
     unsigned int compression_otf_thread_count = std::thread::hardware_concurrency();
+    long long chunk_size = DEFAULT_CHUNK_SIZE;
+    std::string compression_method;
+    // Only decompress this range of the original file, range_offset is -1 if decompressing the whole file
+    long long range_offset = -1;
+    long long range_length = 0;
+    // Budget for the estimated memory usage of the blocks being (de)compressed at the same time, 0 for no limit
+    long long memory_limit = 0;
+    // Write the output bypassing the page cache and drop the input from it as it's consumed
+    bool direct_io = false;
+    // Have the workers pread their blocks from the input file even where it could be memory mapped, that's otherwise only done for
+    // files that can't be mapped (and always on Windows)
+    bool no_mmap = false;
+    // The input is a directory (or "stdin" for a list of files) and every file in it is (de)compressed, see process_batch()
+    bool batch_mode = false;
 
     long long fin_length;
     std::string input_file_name;
     std::string output_file_name;
 
     std::unique_ptr<std::istream> fin = std::unique_ptr<std::istream>(new std::ifstream());
+    // When compressing from a regular file it's also mapped, so blocks are compressed straight from it instead of being read through fin
+    std::unique_ptr<MappedFile> mapped_fin;
+    // If the file can't be mapped but it's still a regular file each worker reads its own block from it
+    std::unique_ptr<PositionalFile> positional_fin;
     std::unique_ptr<std::ostream> fout = std::unique_ptr<std::ostream>(new std::ofstream());
 
     float global_min_percent = 0;
@@ -155,58 +177,122 @@ int parseIntUntilEnd(const char* c, const char* context, int too_big_error_code
     return parseInt(x, context, too_big_error_code);
 }
 
-void write_header() {
+long long parseLongLong(const char*& c, const char* context) {
+    if (*c < '0' || *c > '9') {
+        print_to_console("ERROR: Number needed to set %s\n", context);
+        exit(1);
+    }
+    long long val = *c++ - '0';
+    while (*c >= '0' && *c <= '9') {
+        if (val >= LLONG_MAX / 10 - 1) {
+            print_to_console("ERROR: Number too big for %s\n", context);
+            exit(1);
+        }
+        val = val * 10 + *c++ - '0';
+    }
+    return val;
+}
+
+// Parses a size in bytes, optionally followed by a K, M or G suffix
+long long parseSizeUntilEnd(const char* c, const char* context) {
+    long long val = parseInt(c, context);
+    switch (toupper(*c)) {
+        case 0: return val;
+        case 'K': val <<= 10; break;
+        case 'M': val <<= 20; break;
+        case 'G': val <<= 30; break;
+        default:
+        {
+            print_to_console("ERROR: Only numbers followed by an optional K, M or G suffix allowed for %s\n", context);
+            exit(1);
+        }
+    }
+    if (c[1] != 0) {
+        print_to_console("ERROR: Only numbers followed by an optional K, M or G suffix allowed for %s\n", context);
+        exit(1);
+    }
+    return val;
+}
+
+// An input that would fit in fewer chunks than there are threads is split evenly across all of them instead, as with one block per
+// thread they all finish at about the same time. Not below MIN_ADAPTIVE_CHUNK_SIZE though (unless max_chunk_size already is).
+// The compressed stream also carries the 1 byte marker written ahead of the data, so that's split too or it'd spill into an extra block.
+long long adaptive_chunk_size(long long input_size, unsigned int thread_count, long long max_chunk_size) {
+    const long long stream_size = input_size + 1;
+    const long long per_thread_size = (stream_size + thread_count - 1) / std::max<unsigned int>(thread_count, 1);
+    return std::clamp(per_thread_size, std::min(MIN_ADAPTIVE_CHUNK_SIZE, max_chunk_size), max_chunk_size);
+}
+
+void write_header(std::ostream& fout, const std::string& input_file_name, long long chunk_size) {
   // write the PCF file header, beware that this needs to be done before wrapping the output file with a CompressedOStreamBuffer
-  char* input_file_name_without_path = new char[g_pzpipe.input_file_name.length() + 1];
+  char* input_file_name_without_path = new char[input_file_name.length() + 1];
 
-  ostream_printf(*g_pzpipe.fout, "PCF");
+  ostream_printf(fout, "PCF");
 
   // version number
-  g_pzpipe.fout->put(V_MAJOR);
-  g_pzpipe.fout->put(V_MINOR);
-  g_pzpipe.fout->put(V_MINOR2);
+  fout.put(V_MAJOR);
+  fout.put(V_MINOR);
+  fout.put(V_MINOR2);
+
+  // chunk size, so the decompressor can size its buffers accordingly
+  for (int i = 0; i < 4; i++) {
+    fout.put(static_cast<char>((chunk_size >> (i * 8)) & 0xFF));
+  }
 
   // write input file name without path
-  const char* last_backslash = strrchr(g_pzpipe.input_file_name.c_str(), PATH_DELIM);
+  const char* last_backslash = strrchr(input_file_name.c_str(), PATH_DELIM);
   if (last_backslash != nullptr) {
     strcpy(input_file_name_without_path, last_backslash + 1);
   } else {
-    strcpy(input_file_name_without_path, g_pzpipe.input_file_name.c_str());
+    strcpy(input_file_name_without_path, input_file_name.c_str());
   }
 
-  ostream_printf(*g_pzpipe.fout, input_file_name_without_path);
-  g_pzpipe.fout->put(0);
+  ostream_printf(fout, input_file_name_without_path);
+  fout.put(0);
 
   delete[] input_file_name_without_path;
 }
 
-void read_header() {
+// Returns false (after telling why) if the header is not valid
+bool read_header(std::istream& fin, const std::string& input_file_name, long long& chunk_size, std::string& header_filename) {
   unsigned char in[3];
-  g_pzpipe.fin->read(reinterpret_cast<char*>(in), 3);
+  fin.read(reinterpret_cast<char*>(in), 3);
   if ((in[0] == 'P') && (in[1] == 'C') && (in[2] == 'F')) {
   } else {
-    print_to_console("Input file %s has no valid PCF header\n", g_pzpipe.input_file_name.c_str());
-    exit(1);
+    print_to_console("Input file %s has no valid PCF header\n", input_file_name.c_str());
+    return false;
   }
 
-  g_pzpipe.fin->read(reinterpret_cast<char*>(in), 3);
+  fin.read(reinterpret_cast<char*>(in), 3);
   if ((in[0] == V_MAJOR) && (in[1] == V_MINOR) && (in[2] == V_MINOR2)) {
   } else {
-    print_to_console("Input file %s was made with a different PZPipe version\n", g_pzpipe.input_file_name.c_str());
+    print_to_console("Input file %s was made with a different PZPipe version\n", input_file_name.c_str());
     print_to_console("PCF version info: %i.%i.%i\n", in[0], in[1], in[2]);
-    exit(1);
+    return false;
   }
 
-  std::string header_filename = "";
+  unsigned char chunk_size_bytes[4];
+  fin.read(reinterpret_cast<char*>(chunk_size_bytes), 4);
+  chunk_size = 0;
+  for (int i = 3; i >= 0; i--) {
+    chunk_size = (chunk_size << 8) | chunk_size_bytes[i];
+  }
+  if (chunk_size < MIN_CHUNK_SIZE || chunk_size > MAX_CHUNK_SIZE) {
+    print_to_console("Input file %s has an invalid chunk size on its PCF header\n", input_file_name.c_str());
+    return false;
+  }
+
+  header_filename = "";
   char c;
   do {
-    c = g_pzpipe.fin->get();
+    c = fin.get();
     if (c != 0) header_filename += c;
-  } while (c != 0);
-
-  if (g_pzpipe.output_file_name.empty()) {
-    g_pzpipe.output_file_name = header_filename;
+  } while (c != 0 && fin.good());
+  if (!fin.good()) {
+    print_to_console("Input file %s has an incomplete PCF header\n", input_file_name.c_str());
+    return false;
   }
+  return true;
 }
 
 long long fileSize64(const char* filename) {
@@ -223,6 +309,54 @@ bool file_exists(const char* filename) {
     return retval;
 }
 
+// Returns nullptr if the file can't be opened
+std::unique_ptr<std::istream> open_input_file(const std::string& filename, int operation, bool allow_async = true) {
+#ifdef __unix
+    // The compressed file is read ahead asynchronously while the workers decompress what was read before
+    if (allow_async && operation == P_DECOMPRESS && std::filesystem::is_regular_file(filename)) {
+        return open_async_file_istream(filename, g_pzpipe.direct_io);
+    }
+#endif
+    auto fin = std::make_unique<std::ifstream>();
+    fin->open(filename, std::ios_base::in | std::ios_base::binary);
+    if (!fin->is_open()) return nullptr;
+    return fin;
+}
+
+// Regular files are also mapped, so blocks are compressed straight from them, or if that's not possible each worker reads its own block.
+// Both stay null if neither is possible, in which case the file has to be read through a stream.
+void open_compression_input(const std::string& filename, std::unique_ptr<MappedFile>& mapped_fin, std::unique_ptr<PositionalFile>& positional_fin) {
+    if (!g_pzpipe.no_mmap) {
+        mapped_fin = std::make_unique<MappedFile>(filename, g_pzpipe.direct_io);
+        if (mapped_fin->data() != nullptr) return;
+        mapped_fin = nullptr;
+    }
+    positional_fin = std::make_unique<PositionalFile>(filename, g_pzpipe.direct_io);
+    if (!positional_fin->is_open()) positional_fin = nullptr;
+}
+
+// Returns nullptr if the file can't be created.
+// With exclusive it also fails (with errno set to EEXIST) if the file already exists, which is checked and the file created in one go,
+// unlike with file_exists(), so batch files that end up wanting the same output file can't both get it.
+std::unique_ptr<std::ostream> open_output_file(const std::string& filename, bool exclusive = false, bool allow_async = true) {
+    if (exclusive) {
+        FILE* claimed_file = fopen(filename.c_str(), "wbx");
+        if (claimed_file == nullptr) return nullptr;
+        fclose(claimed_file);
+    }
+#ifdef __unix
+    // Written behind our back while the workers keep going, unless it's something like a named pipe that can't be written at offsets
+    std::error_code ec;
+    if (allow_async && (!std::filesystem::exists(filename, ec) || std::filesystem::is_regular_file(filename, ec))) {
+        return open_async_file_ostream(filename, g_pzpipe.direct_io);
+    }
+#endif
+    auto fout = std::make_unique<std::ofstream>();
+    fout->open(filename.c_str(), std::ios_base::out | std::ios_base::binary);
+    if (!fout->is_open()) return nullptr;
+    return fout;
+}
+
 int init(int argc, char* argv[]) {
     int i;
 
@@ -238,6 +372,10 @@ int init(int argc, char* argv[]) {
     int operation = P_COMPRESS;
     bool parse_on = true;
     bool zpaq_thread_count_set = false;
+    bool chunk_size_set = false;
+    bool method_set = false;
+    bool range_set = false;
+    bool memory_limit_set = false;
 
     for (i = 1; (i < argc) && (parse_on); i++) {
         if (argv[i][0] == '-') { // switch
@@ -265,6 +403,80 @@ int init(int argc, char* argv[]) {
                     zpaq_thread_count_set = true;
                     break;
                 }
+                case 'B':
+                {
+                    if (chunk_size_set) {
+                        error(ERR_ONLY_SET_CHUNK_SIZE_ONCE);
+                    }
+                    g_pzpipe.chunk_size = parseSizeUntilEnd(argv[i] + 2, "chunk size");
+                    if (g_pzpipe.chunk_size < MIN_CHUNK_SIZE || g_pzpipe.chunk_size > MAX_CHUNK_SIZE) {
+                        print_to_console("ERROR: Chunk size must be between %lliK and %lliM\n", MIN_CHUNK_SIZE >> 10, MAX_CHUNK_SIZE >> 20);
+                        exit(1);
+                    }
+                    chunk_size_set = true;
+                    break;
+                }
+                case 'M':
+                {
+                    if (method_set) {
+                        error(ERR_ONLY_SET_METHOD_ONCE);
+                    }
+                    g_pzpipe.compression_method = argv[i] + 2;
+                    if (g_pzpipe.compression_method.empty()) {
+                        print_to_console("ERROR: Compression method needed for switch \"%s\"\n", argv[i]);
+                        exit(1);
+                    }
+                    method_set = true;
+                    break;
+                }
+                case '-':
+                {
+                    if (strncmp(argv[i] + 2, "mem-limit=", 10) == 0) {
+                        if (memory_limit_set) {
+                            error(ERR_ONLY_SET_MEM_LIMIT_ONCE);
+                        }
+                        g_pzpipe.memory_limit = parseSizeUntilEnd(argv[i] + 12, "memory limit");
+                        memory_limit_set = true;
+                        break;
+                    }
+                    if (strcmp(argv[i] + 2, "direct-io") == 0) {
+                        g_pzpipe.direct_io = true;
+                        break;
+                    }
+                    if (strcmp(argv[i] + 2, "no-mmap") == 0) {
+                        g_pzpipe.no_mmap = true;
+                        break;
+                    }
+                    if (strncmp(argv[i] + 2, "range=", 6) != 0) {
+                        print_to_console("ERROR: Unknown switch \"%s\"\n", argv[i]);
+                        exit(1);
+                    }
+                    if (range_set) {
+                        error(ERR_ONLY_SET_RANGE_ONCE);
+                    }
+                    const char* range = argv[i] + 8;
+                    g_pzpipe.range_offset = parseLongLong(range, "range offset");
+                    if (*range++ != ':') {
+                        print_to_console("ERROR: Range must be given as offset:length\n");
+                        exit(1);
+                    }
+                    g_pzpipe.range_length = parseLongLong(range, "range length");
+                    if (*range != 0) {
+                        print_to_console("ERROR: Range must be given as offset:length\n");
+                        exit(1);
+                    }
+                    range_set = true;
+                    break;
+                }
+                case 'R':
+                {
+                    if (argv[i][2] != 0) { // Extra Parameters?
+                        print_to_console("ERROR: Unknown switch \"%s\"\n", argv[i]);
+                        exit(1);
+                    }
+                    g_pzpipe.batch_mode = true;
+                    break;
+                }
                 case 'V':
                 {
                     DEBUG_MODE = true;
@@ -313,25 +525,30 @@ int init(int argc, char* argv[]) {
             input_file_given = true;
             g_pzpipe.input_file_name = argv[i];
 
-            if (g_pzpipe.input_file_name == "stdin") {
+            if (g_pzpipe.batch_mode) {
+                // The files are opened one by one later, see process_batch()
+            }
+            else if (g_pzpipe.input_file_name == "stdin") {
                 // Read binary from stdin
                 SET_BINARY_MODE(STDIN);
                 g_pzpipe.fin->rdbuf(std::cin.rdbuf());
             } else {
                 g_pzpipe.fin_length = fileSize64(argv[i]);
 
-                auto fin = std::make_unique<std::ifstream>();
-                fin->open(argv[i], std::ios_base::in | std::ios_base::binary);
-                if (!fin->is_open()) {
+                g_pzpipe.fin = open_input_file(g_pzpipe.input_file_name, operation);
+                if (g_pzpipe.fin == nullptr) {
                     print_to_console("ERROR: Input file \"%s\" doesn't exist\n", g_pzpipe.input_file_name.c_str());
 
                     exit(1);
                 }
-                g_pzpipe.fin = std::move(fin);
+
+                if (operation == P_COMPRESS) {
+                    open_compression_input(g_pzpipe.input_file_name, g_pzpipe.mapped_fin, g_pzpipe.positional_fin);
+                }
             }
 
             // output file given? If not, use input filename with .zpaq extension
-            if ((!output_file_given) && (operation == P_COMPRESS)) {
+            if ((!output_file_given) && (operation == P_COMPRESS) && !g_pzpipe.batch_mode) {
                 g_pzpipe.output_file_name = g_pzpipe.input_file_name + ".zpaq";
                 output_file_given = true;
             }
@@ -346,13 +563,56 @@ int init(int argc, char* argv[]) {
         print_to_console("  o[filename]  Write output to [filename] <[input_file].zpaq or file in header>\n");
         print_to_console("  e            preserve original extension of input name for output name <off>\n");
         print_to_console("  t[count]     Set ZPAQ thread count <auto-detect: %i>\n", auto_detected_thread_count());
+        print_to_console("  b[size]      Set chunk size, K/M/G suffixes allowed, bigger is better ratio, smaller more parallelism\n");
+        print_to_console("               <%lliM, or smaller input files split evenly across threads>\n", DEFAULT_CHUNK_SIZE >> 20);
+        print_to_console("  m[method]    Set libzpaq compression method, 0 (store), 1-2 (LZ77), 3 (BWT/LZ77), 4-5 (CM) or a custom\n");
+        print_to_console("               \"LB,R,t\" or \"x...\" method string, bare levels pick R,t for each block from its data\n");
+        print_to_console("               <built-in level 2 model>\n");
+        print_to_console("  r            Batch mode, (de)compress every file in the input directory (or listed on stdin if input is \"stdin\")\n");
+        print_to_console("               each to its own output next to it <off>\n");
         print_to_console("  v            Verbose (debug) mode <off>\n");
+        print_to_console("  -range=offset:length  Only decompress length bytes starting at offset of the original file <off>\n");
+        print_to_console("  -mem-limit=[size]     Only run as many blocks at once as fit in this much memory, K/M/G suffixes allowed <off>\n");
+        print_to_console("                        Only counts the models, the block buffers (up to about 4 x threads x chunk size) come on top\n");
+        print_to_console("  -direct-io            Write the output with O_DIRECT and drop the input from the page cache as it's used <off>\n");
+        print_to_console("  -no-mmap              Have the workers read the input file with pread instead of memory mapping it <off>\n");
+
+        exit(1);
+    }
 
+    if (range_set && operation != P_DECOMPRESS) {
+        print_to_console("ERROR: Range can only be used when decompressing\n");
         exit(1);
     }
 
+    // Only if the chunk size wasn't set explicitly and we know the input's size (so not for stdin or batches)
+    if (operation == P_COMPRESS && !chunk_size_set && !g_pzpipe.batch_mode && g_pzpipe.input_file_name != "stdin" && g_pzpipe.fin_length > 0) {
+        g_pzpipe.chunk_size = adaptive_chunk_size(g_pzpipe.fin_length, g_pzpipe.compression_otf_thread_count, g_pzpipe.chunk_size);
+    }
+
+    if (method_set) {
+        try {
+            validate_compression_settings(g_pzpipe.compression_method, g_pzpipe.chunk_size);
+        }
+        catch (const std::exception& e) {
+            print_to_console("ERROR: %s\n", e.what());
+            exit(1);
+        }
+    }
+
+    if (g_pzpipe.batch_mode) {
+        if (output_file_given || range_set) {
+            print_to_console("ERROR: Output file and range can't be used with -r, each file's output goes next to it\n");
+            exit(1);
+        }
+        print_to_console("Input %s: %s\n\n", g_pzpipe.input_file_name == "stdin" ? "list" : "directory", g_pzpipe.input_file_name.c_str());
+        return operation;
+    }
+
     if (operation == P_DECOMPRESS) {
-        read_header();
+        std::string header_filename;
+        if (!read_header(*g_pzpipe.fin, g_pzpipe.input_file_name, g_pzpipe.chunk_size, header_filename)) exit(1);
+        if (g_pzpipe.output_file_name.empty()) g_pzpipe.output_file_name = header_filename;
     }
 
     if (output_file_given && g_pzpipe.output_file_name == "stdout") {
@@ -377,13 +637,11 @@ int init(int argc, char* argv[]) {
             }
         }
 
-        auto fout = std::make_unique<std::ofstream>();
-        fout->open(g_pzpipe.output_file_name.c_str(), std::ios_base::out | std::ios_base::binary);
-        if (!fout->is_open()) {
+        g_pzpipe.fout = open_output_file(g_pzpipe.output_file_name);
+        if (g_pzpipe.fout == nullptr) {
             print_to_console("ERROR: Can't create output file \"%s\"\n", g_pzpipe.output_file_name.c_str());
             exit(1);
         }
-        g_pzpipe.fout = std::move(fout);
     }
 
     print_to_console("Input file: %s\n", g_pzpipe.input_file_name.c_str());
@@ -426,6 +684,11 @@ void denit_compress() {
 }
 
 void denit_decompress() {
+  g_pzpipe.fout->flush();
+  if (g_pzpipe.fout->fail()) {
+    print_to_console("ERROR: Can't write output file\n");
+    exit(1);
+  }
   if (!DEBUG_MODE) {
       print_to_console("%s", std::string(14,'\b').c_str());
       print_to_console("100.00%%\n");
@@ -434,13 +697,28 @@ void denit_decompress() {
   printf_time(get_time_ms() - start_time);
 }
 
-static constexpr int COPY_BUF_SIZE = 512;
+// Feeds the compressor the next part of the input, straight from the mapped file or read by the workers themselves if possible.
+// Returns 0 once the input is exhausted.
+long long ingest_input(
+  CompressedOStreamBuffer& zpaq_streambuf, std::istream& fin, const MappedFile* mapped_fin, const PositionalFile* positional_fin, long long input_file_pos
+) {
+  if (mapped_fin != nullptr) {
+    return input_file_pos < mapped_fin->size() ? zpaq_streambuf.ingest(*mapped_fin, input_file_pos, mapped_fin->size() - input_file_pos) : 0;
+  }
+  if (positional_fin != nullptr) {
+    return input_file_pos < positional_fin->size() ? zpaq_streambuf.ingest(*positional_fin, input_file_pos, positional_fin->size() - input_file_pos) : 0;
+  }
+  return zpaq_streambuf.ingest(fin);
+}
 
 bool compress_file(float min_percent = 0, float max_percent = 100) {
-  write_header();
+  write_header(*g_pzpipe.fout, g_pzpipe.input_file_name, g_pzpipe.chunk_size);
   g_pzpipe.fout = wrap_ostream_otf_compression(
     std::move(g_pzpipe.fout),
-    g_pzpipe.compression_otf_thread_count
+    g_pzpipe.compression_otf_thread_count,
+    g_pzpipe.chunk_size,
+    g_pzpipe.compression_method,
+    g_pzpipe.memory_limit
   );
 
   g_pzpipe.global_min_percent = min_percent;
@@ -451,37 +729,60 @@ bool compress_file(float min_percent = 0, float max_percent = 100) {
   g_pzpipe.uncompressed_bytes_total = 0;
   g_pzpipe.uncompressed_bytes_written = 0;
 
-  int bytes_read;
-  unsigned char copybuf[COPY_BUF_SIZE];
-
   long long input_file_pos = 0;
 
   // uncompressed data
   g_pzpipe.fout->put(0);
 
+  // The input is read straight into the compressor's chunk buffers (or compressed right from the mapped file, or read by the workers
+  // themselves from the input file), so we only get here once per block
+  auto zpaq_streambuf = dynamic_cast<CompressedOStreamBuffer*>(g_pzpipe.fout->rdbuf());
   for (;;) {
-    g_pzpipe.fin->read(reinterpret_cast<char*>(copybuf), COPY_BUF_SIZE);
-    bytes_read = g_pzpipe.fin->gcount();
-    if (bytes_read > -1) g_pzpipe.fout->write(reinterpret_cast<char*>(copybuf), bytes_read);
-    if (bytes_read < COPY_BUF_SIZE) {
-      break;
-    }
+    const long long bytes_read = ingest_input(*zpaq_streambuf, *g_pzpipe.fin, g_pzpipe.mapped_fin.get(), g_pzpipe.positional_fin.get(), input_file_pos);
+    if (bytes_read == 0) break;
 
-    input_file_pos = g_pzpipe.fin->tellg();
+    input_file_pos += bytes_read;
     print_work_sign(true);
     if (!DEBUG_MODE) {
       float percent = (input_file_pos / (float)g_pzpipe.fin_length) * 100;
       show_progress(percent, true, true);
     }
   }
+  // Finish here instead of when fout is destroyed, so an error on the last blocks isn't lost
+  zpaq_streambuf->set_stream_eof();
 
   denit_compress();
 
   return true;
 }
 
+// Seeks straight to the block that has the start of the range, so only the blocks overlapping it are decompressed
+void decompress_range() {
+  auto zpaq_streambuf = dynamic_cast<ZpaqIStreamBuffer*>(g_pzpipe.fin->rdbuf());
+  // The uncompressed stream starts with the "uncompressed data" header byte before the original file's data
+  const long long range_start = g_pzpipe.range_offset + 1;
+  g_pzpipe.fin->seekg(range_start);
+  if (g_pzpipe.fin->fail()) {
+    print_to_console("ERROR: Can't seek to range offset %lli, the input must be a file and the offset within the original file\n", g_pzpipe.range_offset);
+    exit(1);
+  }
+  zpaq_streambuf->limit_read_ahead(range_start + g_pzpipe.range_length);
+
+  long long range_left = g_pzpipe.range_length;
+  while (range_left > 0) {
+    const long long amt_written = zpaq_streambuf->write_block_to(*g_pzpipe.fout, range_left);
+    if (amt_written == 0) break;
+    range_left -= amt_written;
+    print_work_sign(true);
+  }
+}
+
 void decompress_file() {
-  g_pzpipe.fin = wrap_istream_otf_compression(std::move(g_pzpipe.fin), g_pzpipe.compression_otf_thread_count);
+  g_pzpipe.fin = wrap_istream_otf_compression(
+    std::move(g_pzpipe.fin), g_pzpipe.compression_otf_thread_count, g_pzpipe.chunk_size, g_pzpipe.memory_limit
+  );
+  // Otherwise the istream would swallow a corrupt block's error and just look like the end of the stream
+  g_pzpipe.fin->exceptions(std::ios_base::badbit);
 
   if (!DEBUG_MODE) show_progress(0, false, false);
 
@@ -492,26 +793,215 @@ void decompress_file() {
     show_progress(percent, true, true);
   }
 
+  if (g_pzpipe.range_offset >= 0) {
+    decompress_range();
+    denit_decompress();
+    return;
+  }
+
   unsigned char header1 = g_pzpipe.fin->get();
   if (header1 == 0) { // uncompressed data
-    int chr = 0;
-    int next_char = g_pzpipe.fin->get();
-    while (g_pzpipe.fin->good()) {
-      chr = next_char;
-      // This is a hack fix, for some reason we are adding a Zeroed byte at the end of the original stream while compressing.
-      // The actual fix is to find out why that is happening and make it no longer happen, for now I just want this to work so if the next chr is EOF
-      // I know we are currently at the last byte of actual data, which is that extra Zeroed byte, so I just drop it and end writing output at that point.
-      next_char = g_pzpipe.fin->get();
-      if (next_char == EOF) break;
-      g_pzpipe.fout->put(chr);
-      fin_pos += 1;
-      if (fin_pos >= g_pzpipe.fin_length) fin_pos = g_pzpipe.fin_length - 1;
+    // Each decompressed block is written to the output in one go as soon as it's ready
+    auto zpaq_streambuf = dynamic_cast<ZpaqIStreamBuffer*>(g_pzpipe.fin->rdbuf());
+    while (zpaq_streambuf->write_block_to(*g_pzpipe.fout, LLONG_MAX) > 0) {
+      print_work_sign(true);
     }
   }
 
   denit_decompress();
 }
 
+// Batch mode producers print from their own threads
+std::mutex batch_console_mtx;
+// Batch files up to this size use plain file streams, their data fits in the async streams' buffers anyway so starting their I/O threads
+// (for each of possibly thousands of files) would be all cost
+constexpr long long SMALL_BATCH_FILE_SIZE = 4 << 20;
+
+// Input files of a batch, .zpaq files are left out when compressing and only they are taken when decompressing a directory,
+// a list given on stdin is taken as is
+std::vector<std::string> collect_batch_files(int operation) {
+  std::vector<std::string> files;
+  if (g_pzpipe.input_file_name == "stdin") {
+    std::string line;
+    while (std::getline(std::cin, line)) {
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      if (!line.empty()) files.push_back(line);
+    }
+    return files;
+  }
+
+  std::error_code ec;
+  auto dir_iterator = std::filesystem::recursive_directory_iterator(
+    g_pzpipe.input_file_name, std::filesystem::directory_options::skip_permission_denied, ec
+  );
+  if (ec) {
+    print_to_console("ERROR: Can't read input directory \"%s\"\n", g_pzpipe.input_file_name.c_str());
+    exit(1);
+  }
+  for (; dir_iterator != std::filesystem::recursive_directory_iterator(); dir_iterator.increment(ec)) {
+    if (ec) break;
+    if (!dir_iterator->is_regular_file(ec)) continue;
+    const bool is_zpaq = dir_iterator->path().extension() == ".zpaq";
+    if (is_zpaq == (operation == P_DECOMPRESS)) files.push_back(dir_iterator->path().string());
+  }
+  return files;
+}
+
+// Batch outputs are created exclusively, so a truncated one left behind by a file that failed would have every later run skip that file
+void remove_failed_output(const std::string& output_file_name) {
+  std::error_code ec;
+  std::filesystem::remove(output_file_name, ec);
+}
+
+// Same as compress_file() but on its own streams, so several files can be compressed at the same time on a shared pool.
+// Returns false (after telling why) if the file was skipped.
+bool compress_batch_file(const std::string& input_file_name, const std::shared_ptr<ZpaqWorkerPool>& worker_pool, unsigned int max_pending_blocks) {
+  const std::string output_file_name = input_file_name + ".zpaq";
+  auto fin = open_input_file(input_file_name, P_COMPRESS);
+  if (fin == nullptr) {
+    std::unique_lock lock(batch_console_mtx);
+    print_to_console("Skipping \"%s\", can't open it\n", input_file_name.c_str());
+    return false;
+  }
+  const long long input_size = fileSize64(input_file_name.c_str());
+  auto fout = open_output_file(output_file_name, true, input_size > SMALL_BATCH_FILE_SIZE);
+  if (fout == nullptr) {
+    const bool output_exists = errno == EEXIST;
+    std::unique_lock lock(batch_console_mtx);
+    print_to_console("Skipping \"%s\", %s\n", input_file_name.c_str(), output_exists ? "output file exists" : "can't create its output file");
+    return false;
+  }
+  std::unique_ptr<MappedFile> mapped_fin;
+  std::unique_ptr<PositionalFile> positional_fin;
+  open_compression_input(input_file_name, mapped_fin, positional_fin);
+
+  // A file smaller than a chunk is a single block anyway, so there is no point in allocating buffers for a whole chunk
+  const long long chunk_size = std::clamp(input_size, MIN_CHUNK_SIZE, g_pzpipe.chunk_size);
+  try {
+    write_header(*fout, input_file_name, chunk_size);
+    ZpaqOStreamBuffer zpaq_streambuf(std::move(fout), worker_pool, chunk_size, g_pzpipe.compression_method, max_pending_blocks);
+    zpaq_streambuf.sputc(0);  // uncompressed data
+    long long input_file_pos = 0;
+    for (;;) {
+      const long long bytes_read = ingest_input(zpaq_streambuf, *fin, mapped_fin.get(), positional_fin.get(), input_file_pos);
+      if (bytes_read == 0) break;
+      input_file_pos += bytes_read;
+    }
+    zpaq_streambuf.set_stream_eof();
+  }
+  catch (...) {
+    // The output was closed along with zpaq_streambuf
+    remove_failed_output(output_file_name);
+    throw;
+  }
+  return true;
+}
+
+// Same as decompress_file() but on its own streams, the output goes next to the compressed file with the name from its header.
+// Returns false (after telling why) if the file was skipped.
+bool decompress_batch_file(const std::string& input_file_name, const std::shared_ptr<ZpaqWorkerPool>& worker_pool, unsigned int read_ahead_blocks) {
+  // The compressed size is all we know up front, a small file could still decompress to a big one but the async streams wouldn't make
+  // much of a difference then as other files are being worked on at the same time
+  const bool is_small = fileSize64(input_file_name.c_str()) <= SMALL_BATCH_FILE_SIZE;
+  auto fin = open_input_file(input_file_name, P_DECOMPRESS, !is_small);
+  if (fin == nullptr) {
+    std::unique_lock lock(batch_console_mtx);
+    print_to_console("Skipping \"%s\", can't open it\n", input_file_name.c_str());
+    return false;
+  }
+  long long chunk_size;
+  std::string header_filename;
+  {
+    std::unique_lock lock(batch_console_mtx);
+    if (!read_header(*fin, input_file_name, chunk_size, header_filename)) return false;
+  }
+  // Only the name, so a crafted header can't get us to write anywhere else
+  const std::filesystem::path header_path = std::filesystem::path(header_filename).filename();
+  const std::string output_file_name = (std::filesystem::path(input_file_name).parent_path() / header_path).string();
+  if (header_path.empty()) {
+    std::unique_lock lock(batch_console_mtx);
+    print_to_console("Skipping \"%s\", its header has no output file name\n", input_file_name.c_str());
+    return false;
+  }
+  auto fout = open_output_file(output_file_name, true, !is_small);
+  if (fout == nullptr) {
+    const bool output_exists = errno == EEXIST;
+    std::unique_lock lock(batch_console_mtx);
+    if (output_exists) print_to_console("Skipping \"%s\", output file \"%s\" exists\n", input_file_name.c_str(), output_file_name.c_str());
+    else print_to_console("Skipping \"%s\", can't create output file \"%s\"\n", input_file_name.c_str(), output_file_name.c_str());
+    return false;
+  }
+
+  try {
+    ZpaqIStreamBuffer zpaq_streambuf(std::move(fin), worker_pool, chunk_size, read_ahead_blocks);
+    if (zpaq_streambuf.sbumpc() == 0) { // uncompressed data
+      while (zpaq_streambuf.write_block_to(*fout, LLONG_MAX) > 0) {}
+    }
+    fout->flush();
+    if (fout->fail()) throw std::runtime_error("can't write output file");
+  }
+  catch (...) {
+    fout = nullptr;
+    remove_failed_output(output_file_name);
+    throw;
+  }
+  return true;
+}
+
+// Every file's blocks go to the same pool, with as many files being (de)compressed at once as the pool has threads, so many small files
+// (a single block each) keep every thread busy the same as a big one. Each file only gets a couple of blocks in flight, so the blocks
+// in flight (and their buffers) add up to about the same as for a single file.
+// Returns false if any file failed or was skipped.
+bool process_batch(int operation) {
+  const auto files = collect_batch_files(operation);
+  const unsigned int thread_count = std::max<unsigned int>(g_pzpipe.compression_otf_thread_count, 1);
+  auto worker_pool = std::make_shared<ZpaqWorkerPool>(thread_count, thread_count, g_pzpipe.memory_limit);
+  constexpr unsigned int blocks_per_file = 2;
+
+  std::atomic<size_t> next_file = 0;
+  size_t files_done = 0;
+  size_t files_failed = 0;
+  if (!DEBUG_MODE) show_progress(0, false, false);
+  auto producer = [&]() {
+    while (true) {
+      const size_t file_index = next_file++;
+      if (file_index >= files.size()) return;
+      const std::string& file = files[file_index];
+      bool done;
+      try {
+        done = operation == P_COMPRESS
+          ? compress_batch_file(file, worker_pool, blocks_per_file)
+          : decompress_batch_file(file, worker_pool, blocks_per_file);
+      }
+      catch (const std::exception& e) {
+        std::unique_lock lock(batch_console_mtx);
+        print_to_console("ERROR: \"%s\" failed: %s\n", file.c_str(), e.what());
+        done = false;
+      }
+
+      std::unique_lock lock(batch_console_mtx);
+      files_done++;
+      if (!done) files_failed++;
+      if (DEBUG_MODE) print_to_console("%s\n", file.c_str());
+      else show_progress((files_done / static_cast<float>(files.size())) * 100, true, true);
+    }
+  };
+  std::vector<std::thread> producers;
+  for (unsigned int i = 1; i < std::min<size_t>(thread_count, files.size()); i++) {
+    producers.emplace_back(producer);
+  }
+  producer();
+  for (auto& thread : producers) {
+    thread.join();
+  }
+
+  if (!DEBUG_MODE) print_to_console("%s", std::string(14, '\b').c_str());
+  print_to_console("%zu file(s) done, %zu failed or skipped\n", files_done - files_failed, files_failed);
+  print_to_console("\nDone.\n");
+  printf_time(get_time_ms() - start_time);
+  return files_failed == 0;
+}
+
 void ctrl_c_handler(int sig) {
     print_to_console("\n\nCTRL-C detected\n");
     (void) signal(SIGINT, SIG_DFL);
@@ -524,21 +1014,33 @@ int main(int argc, char* argv[])
   // register CTRL-C handler
   (void) signal(SIGINT, ctrl_c_handler);
 
-  switch (init(argc, argv)) {
+  // libzpaq errors (corrupt input, invalid methods) and failed writes end up here, no matter which thread hit them
+  try {
+    const int operation = init(argc, argv);
+    if (g_pzpipe.batch_mode) {
+      start_time = get_time_ms();
+      return process_batch(operation) ? 0 : 1;
+    }
+    switch (operation) {
 
-    case P_COMPRESS:
-      {
-        start_time = get_time_ms();
-        compress_file();
-        break;
-      }
+      case P_COMPRESS:
+        {
+          start_time = get_time_ms();
+          compress_file();
+          break;
+        }
 
-    case P_DECOMPRESS:
-      {
-        start_time = get_time_ms();
-        decompress_file();
-        break;
-      }
+      case P_DECOMPRESS:
+        {
+          start_time = get_time_ms();
+          decompress_file();
+          break;
+        }
+    }
+  }
+  catch (const std::exception& e) {
+    fprintf(stderr, "Oops: %s\n", e.what());
+    exit(1);
   }
 
   return 0;
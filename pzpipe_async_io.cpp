@@ -0,0 +1,523 @@
+#include "pzpipe_async_io.h"
+#ifdef __unix
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef PZPIPE_IO_URING
+#include <atomic>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+void AsyncIOBufferDeleter::operator()(char* buf) const {
+  ::operator delete[](buf, std::align_val_t(DIRECT_IO_ALIGNMENT));
+}
+
+AsyncIOBuffer make_async_io_buffer(long long size) {
+  return AsyncIOBuffer(static_cast<char*>(::operator new[](size, std::align_val_t(DIRECT_IO_ALIGNMENT))));
+}
+
+// Blocking pread/pwrite of the whole request, returns the amount transferred (less than size only at the end of the file) or a negative errno
+static long long transfer_fully(int fd, char* buf, long long size, long long offset, bool is_write) {
+  long long done = 0;
+  while (done < size) {
+    const auto amt = is_write ? pwrite(fd, buf + done, size - done, offset + done) : pread(fd, buf + done, size - done, offset + done);
+    if (amt < 0 && errno == EINTR) continue;
+    if (amt < 0) return -errno;
+    if (amt == 0) break;
+    done += amt;
+  }
+  return done;
+}
+
+// Fallback backend, each request is handed to one of a few threads that do a blocking pread/pwrite
+class ThreadFileIO : public AsyncFileIO
+{
+public:
+  ThreadFileIO(int fd, unsigned int buffer_count) : fd(fd), results(buffer_count, 0), pending(buffer_count, false) {
+    for (unsigned int i = 0; i < buffer_count; i++) {
+      threads.emplace_back(&ThreadFileIO::thread_loop, this);
+    }
+  }
+
+  ~ThreadFileIO() override {
+    {
+      std::unique_lock lock(mtx);
+      stopping = true;
+    }
+    request_queued.notify_all();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  void submit_read(unsigned int buffer_index, char* buf, long long size, long long offset) override {
+    submit({ buffer_index, buf, size, offset, false });
+  }
+
+  void submit_write(unsigned int buffer_index, const char* buf, long long size, long long offset) override {
+    submit({ buffer_index, const_cast<char*>(buf), size, offset, true });
+  }
+
+  long long wait(unsigned int buffer_index) override {
+    std::unique_lock lock(mtx);
+    request_done.wait(lock, [this, buffer_index]() { return !pending[buffer_index]; });
+    return results[buffer_index];
+  }
+
+private:
+  class Request
+  {
+  public:
+    unsigned int buffer_index;
+    char* buf;
+    long long size;
+    long long offset;
+    bool is_write;
+  };
+
+  int fd;
+  std::vector<long long> results;
+  std::vector<bool> pending;
+  std::deque<Request> requests;
+  std::vector<std::thread> threads;
+  bool stopping = false;
+  std::mutex mtx;
+  std::condition_variable request_queued;
+  std::condition_variable request_done;
+
+  void submit(Request&& request) {
+    {
+      std::unique_lock lock(mtx);
+      pending[request.buffer_index] = true;
+      requests.emplace_back(request);
+    }
+    request_queued.notify_one();
+  }
+
+  void thread_loop() {
+    while (true) {
+      Request request {};
+      {
+        std::unique_lock lock(mtx);
+        request_queued.wait(lock, [this]() { return stopping || !requests.empty(); });
+        if (requests.empty()) return;  // only possible if stopping
+        request = requests.front();
+        requests.pop_front();
+      }
+      const long long done = transfer_fully(fd, request.buf, request.size, request.offset, request.is_write);
+      {
+        std::unique_lock lock(mtx);
+        results[request.buffer_index] = done;
+        pending[request.buffer_index] = false;
+      }
+      request_done.notify_all();
+    }
+  }
+};
+
+#ifdef PZPIPE_IO_URING
+// io_uring through the raw syscalls, so there is no dependency on liburing. The buffers are registered with the ring if the memlock
+// limit allows it, which saves the kernel from mapping them on every request.
+class IoUringFileIO : public AsyncFileIO
+{
+public:
+  IoUringFileIO(int fd, const std::vector<AsyncIOBuffer>& buffers)
+    : fd(fd), results(buffers.size(), 0), pending(buffers.size(), false) {
+    io_uring_params params {};
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, buffers.size(), &params));
+    if (ring_fd < 0) return;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = single_mmap
+      ? sq_ring
+      : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+      close_ring();
+      return;
+    }
+
+    auto sq_base = static_cast<char*>(sq_ring);
+    sq_tail = reinterpret_cast<unsigned*>(sq_base + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq_base + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq_base + params.sq_off.array);
+    auto cq_base = static_cast<char*>(cq_ring);
+    cq_head = reinterpret_cast<unsigned*>(cq_base + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq_base + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq_base + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq_base + params.cq_off.cqes);
+
+    std::vector<iovec> iovecs;
+    for (const auto& buffer : buffers) {
+      iovecs.push_back({ buffer.get(), static_cast<size_t>(ASYNC_IO_BUFFER_SIZE) });
+    }
+    registered_buffers = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iovecs.data(), iovecs.size()) == 0;
+  }
+
+  ~IoUringFileIO() override {
+    for (unsigned int i = 0; i < pending.size(); i++) {
+      if (pending[i]) wait(i);
+    }
+    close_ring();
+  }
+
+  [[nodiscard]] bool is_ready() const { return ring_fd >= 0; }
+
+  void submit_read(unsigned int buffer_index, char* buf, long long size, long long offset) override {
+    submit(registered_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ, buffer_index, buf, size, offset);
+  }
+
+  void submit_write(unsigned int buffer_index, const char* buf, long long size, long long offset) override {
+    submit(registered_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, buffer_index, const_cast<char*>(buf), size, offset);
+  }
+
+  long long wait(unsigned int buffer_index) override {
+    while (pending[buffer_index]) {
+      if (!reap_completion()) syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+    }
+    return results[buffer_index];
+  }
+
+private:
+  int fd;
+  int ring_fd = -1;
+  void* sq_ring = MAP_FAILED;
+  void* cq_ring = MAP_FAILED;
+  size_t sq_ring_size = 0;
+  size_t cq_ring_size = 0;
+  io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+  size_t sqes_size = 0;
+  unsigned* sq_tail = nullptr;
+  unsigned* sq_mask = nullptr;
+  unsigned* sq_array = nullptr;
+  unsigned* cq_head = nullptr;
+  unsigned* cq_tail = nullptr;
+  unsigned* cq_mask = nullptr;
+  io_uring_cqe* cqes = nullptr;
+  bool registered_buffers = false;
+  std::vector<long long> results;
+  std::vector<bool> pending;
+
+  // Times io_uring_enter is retried when the kernel is temporarily out of resources for the request
+  static constexpr int SUBMIT_ATTEMPTS = 16;
+
+  // Takes the result of the next completed request off the completion queue, returns false if there isn't any
+  bool reap_completion() {
+    const unsigned head = *cq_head;
+    if (head == std::atomic_ref(*cq_tail).load(std::memory_order_acquire)) return false;
+    const io_uring_cqe& cqe = cqes[head & *cq_mask];
+    results[cqe.user_data] = cqe.res;
+    pending[cqe.user_data] = false;
+    std::atomic_ref(*cq_head).store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // There is never more than one request per buffer and the ring has as many entries as buffers, so it can't be full here.
+  // If the kernel won't take the request it's done synchronously instead, so wait() never waits for a request that wasn't submitted.
+  void submit(unsigned char opcode, unsigned int buffer_index, char* buf, long long size, long long offset) {
+    const unsigned tail = *sq_tail;
+    const unsigned index = tail & *sq_mask;
+    io_uring_sqe& sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<unsigned long long>(buf);
+    sqe.len = static_cast<unsigned>(size);
+    sqe.off = offset;
+    if (registered_buffers) sqe.buf_index = buffer_index;
+    sqe.user_data = buffer_index;
+    sq_array[index] = index;
+    std::atomic_ref(*sq_tail).store(tail + 1, std::memory_order_release);
+    pending[buffer_index] = true;
+    for (int attempt = 0; attempt < SUBMIT_ATTEMPTS;) {
+      const long submitted = syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0);
+      if (submitted > 0) return;
+      if (submitted < 0 && errno == EINTR) continue;
+      if (submitted < 0 && errno != EAGAIN && errno != EBUSY) break;
+      // EBUSY means the completion queue is full, reaping what's there might be enough to make room
+      while (reap_completion()) {}
+      std::this_thread::yield();
+      attempt++;
+    }
+    // The kernel didn't consume the entry, so it can be taken back
+    std::atomic_ref(*sq_tail).store(tail, std::memory_order_release);
+    const bool is_write = opcode == IORING_OP_WRITE || opcode == IORING_OP_WRITE_FIXED;
+    results[buffer_index] = transfer_fully(fd, buf, size, offset, is_write);
+    pending[buffer_index] = false;
+  }
+
+  void close_ring() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0) close(ring_fd);
+    ring_fd = -1;
+  }
+};
+#endif
+
+std::unique_ptr<AsyncFileIO> AsyncFileIO::create(int fd, const std::vector<AsyncIOBuffer>& buffers) {
+#ifdef PZPIPE_IO_URING
+  auto io_uring = std::make_unique<IoUringFileIO>(fd, buffers);
+  if (io_uring->is_ready()) return io_uring;
+#endif
+  return std::make_unique<ThreadFileIO>(fd, buffers.size());
+}
+
+AsyncFileOStreamBuffer::AsyncFileOStreamBuffer(int fd, bool direct_io)
+  : fd(fd), direct_io(direct_io), pending_sizes(ASYNC_IO_QUEUE_DEPTH, 0), pending_offsets(ASYNC_IO_QUEUE_DEPTH, 0) {
+  for (unsigned int i = 0; i < ASYNC_IO_QUEUE_DEPTH; i++) {
+    buffers.emplace_back(make_async_io_buffer(ASYNC_IO_BUFFER_SIZE));
+  }
+  async_io = AsyncFileIO::create(fd, buffers);
+  setp(buffers[0].get(), buffers[0].get() + ASYNC_IO_BUFFER_SIZE);
+}
+
+AsyncFileOStreamBuffer::~AsyncFileOStreamBuffer() {
+  const long long file_size = file_offset + (pptr() - pbase());
+  submit_current(true);
+  sync();
+  // Get rid of the padding of the last block
+  if (direct_io && file_offset != file_size) {
+    while (ftruncate(fd, file_size) < 0 && errno == EINTR) {}
+  }
+  async_io = nullptr;
+  close(fd);
+}
+
+// With direct_io, unless this is the final write, only the aligned part of the buffer is written and the rest is carried over
+// to the next buffer
+void AsyncFileOStreamBuffer::submit_current(bool final) {
+  long long size = pptr() - pbase();
+  long long carry_over = 0;
+  if (direct_io) {
+    if (final) {
+      const long long padded_size = (size + DIRECT_IO_ALIGNMENT - 1) & ~(DIRECT_IO_ALIGNMENT - 1);
+      memset(pptr(), 0, padded_size - size);
+      size = padded_size;
+    }
+    else {
+      carry_over = size & (DIRECT_IO_ALIGNMENT - 1);
+      size -= carry_over;
+    }
+  }
+  if (size == 0) return;
+  async_io->submit_write(curr_buffer, pbase(), size, file_offset);
+  pending_sizes[curr_buffer] = size;
+  pending_offsets[curr_buffer] = file_offset;
+  file_offset += size;
+  const char* carry_over_data = pbase() + size;
+  curr_buffer = (curr_buffer + 1) % buffers.size();
+  wait_buffer(curr_buffer);
+  setp(buffers[curr_buffer].get(), buffers[curr_buffer].get() + ASYNC_IO_BUFFER_SIZE);
+  if (carry_over > 0) {
+    memcpy(pptr(), carry_over_data, carry_over);
+    pbump(static_cast<int>(carry_over));
+  }
+}
+
+void AsyncFileOStreamBuffer::wait_buffer(unsigned int buffer_index) {
+  const long long size = pending_sizes[buffer_index];
+  if (size == 0) return;
+  // A short or failed write is retried synchronously, as it should be rare. If it fails again so be it.
+  long long written = std::max(async_io->wait(buffer_index), 0LL);
+  while (written < size) {
+    const auto amt = pwrite(fd, buffers[buffer_index].get() + written, size - written, pending_offsets[buffer_index] + written);
+    if (amt < 0 && errno == EINTR) continue;
+    if (amt <= 0) break;
+    written += amt;
+  }
+  if (written != size) write_failed = true;
+  pending_sizes[buffer_index] = 0;
+}
+
+int AsyncFileOStreamBuffer::overflow(int c) {
+  submit_current();
+  if (write_failed) return EOF;
+  if (c != EOF) {
+    *pptr() = static_cast<char>(c);
+    pbump(1);
+  }
+  return c == EOF ? 0 : c;
+}
+
+// With direct_io the tail that isn't a whole aligned block stays on the put area until more data completes it. To have it on the file
+// anyway it's written padded now, and rewritten along with whatever follows it later.
+void AsyncFileOStreamBuffer::write_unaligned_tail() {
+  const long long size = pptr() - pbase();
+  const long long padded_size = (size + DIRECT_IO_ALIGNMENT - 1) & ~(DIRECT_IO_ALIGNMENT - 1);
+  memset(pptr(), 0, padded_size - size);
+  long long written = 0;
+  while (written < padded_size) {
+    const auto amt = pwrite(fd, pbase() + written, padded_size - written, file_offset + written);
+    if (amt < 0 && errno == EINTR) continue;
+    if (amt <= 0) break;
+    written += amt;
+  }
+  if (written != padded_size) write_failed = true;
+}
+
+int AsyncFileOStreamBuffer::sync() {
+  submit_current();
+  if (direct_io && pptr() > pbase()) write_unaligned_tail();
+  for (unsigned int i = 0; i < buffers.size(); i++) {
+    wait_buffer(i);
+  }
+  return write_failed ? -1 : 0;
+}
+
+AsyncFileIStreamBuffer::AsyncFileIStreamBuffer(int fd, bool drop_page_cache)
+  : fd(fd), drop_page_cache(drop_page_cache), buffer_offsets(ASYNC_IO_QUEUE_DEPTH, -1) {
+  struct stat file_stat {};
+  if (fstat(fd, &file_stat) == 0) file_size = file_stat.st_size;
+  for (unsigned int i = 0; i < ASYNC_IO_QUEUE_DEPTH; i++) {
+    buffers.emplace_back(make_async_io_buffer(ASYNC_IO_BUFFER_SIZE));
+  }
+  async_io = AsyncFileIO::create(fd, buffers);
+}
+
+AsyncFileIStreamBuffer::~AsyncFileIStreamBuffer() {
+  for (unsigned int i = 0; i < buffers.size(); i++) {
+    if (buffer_offsets[i] >= 0) async_io->wait(i);
+  }
+  async_io = nullptr;
+  close(fd);
+}
+
+void AsyncFileIStreamBuffer::submit_read(unsigned int buffer_index) {
+  if (next_read_offset >= file_size) {
+    buffer_offsets[buffer_index] = -1;
+    return;
+  }
+  const long long size = std::min(ASYNC_IO_BUFFER_SIZE, file_size - next_read_offset);
+  async_io->submit_read(buffer_index, buffers[buffer_index].get(), size, next_read_offset);
+  buffer_offsets[buffer_index] = next_read_offset;
+  next_read_offset += size;
+}
+
+// Drops whatever was read ahead and starts reading ahead from offset
+void AsyncFileIStreamBuffer::restart_read_ahead(long long offset) {
+  for (unsigned int i = 0; i < buffers.size(); i++) {
+    if (buffer_offsets[i] >= 0) async_io->wait(i);
+  }
+  next_read_offset = offset;
+  for (unsigned int i = 0; i < buffers.size(); i++) {
+    submit_read((curr_buffer + i) % buffers.size());
+  }
+  get_area_offset = offset;
+  setg(nullptr, nullptr, nullptr);
+  read_ahead_stopped = false;
+}
+
+int AsyncFileIStreamBuffer::underflow() {
+  if (gptr() < egptr()) return static_cast<unsigned char>(*gptr());
+  if (read_ahead_stopped) restart_read_ahead(read_offset);
+
+  if (eback() != nullptr) {
+    // The current buffer was consumed, reuse it to keep reading ahead, and move on to the next one
+    if (drop_page_cache) posix_fadvise(fd, get_area_offset, egptr() - eback(), POSIX_FADV_DONTNEED);
+    get_area_offset += egptr() - eback();
+    submit_read(curr_buffer);
+    curr_buffer = (curr_buffer + 1) % buffers.size();
+  }
+
+  const long long offset = buffer_offsets[curr_buffer];
+  if (offset < 0) {
+    setg(nullptr, nullptr, nullptr);
+    return EOF;
+  }
+  const long long size = std::min(ASYNC_IO_BUFFER_SIZE, file_size - offset);
+  // Same as writes, short reads are completed synchronously, the following buffers were already requested from where this one should end
+  long long amt_read = std::max(async_io->wait(curr_buffer), 0LL);
+  while (amt_read < size) {
+    const auto amt = pread(fd, buffers[curr_buffer].get() + amt_read, size - amt_read, offset + amt_read);
+    if (amt < 0 && errno == EINTR) continue;
+    if (amt <= 0) break;
+    amt_read += amt;
+  }
+  buffer_offsets[curr_buffer] = -1;
+  if (amt_read == 0) {
+    setg(nullptr, nullptr, nullptr);
+    return EOF;
+  }
+
+  char* buffer = buffers[curr_buffer].get();
+  setg(buffer, buffer, buffer + amt_read);
+  return static_cast<unsigned char>(*gptr());
+}
+
+std::streamsize AsyncFileIStreamBuffer::xsgetn(char* s, std::streamsize n) {
+  if (!read_ahead_stopped) return std::streambuf::xsgetn(s, n);
+  if (reads_since_seek >= READS_BEFORE_READ_AHEAD) {
+    restart_read_ahead(read_offset);
+    return std::streambuf::xsgetn(s, n);
+  }
+  reads_since_seek++;
+  const long long size = std::min<long long>(n, file_size - read_offset);
+  long long amt_read = 0;
+  while (amt_read < size) {
+    const auto amt = pread(fd, s + amt_read, size - amt_read, read_offset + amt_read);
+    if (amt < 0 && errno == EINTR) continue;
+    if (amt <= 0) break;
+    amt_read += amt;
+  }
+  read_offset += amt_read;
+  return amt_read;
+}
+
+AsyncFileIStreamBuffer::pos_type AsyncFileIStreamBuffer::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+  const long long curr_pos = read_ahead_stopped ? read_offset : get_area_offset + (gptr() - eback());
+  if (dir == std::ios_base::cur) return seekpos(curr_pos + off, which);
+  if (dir == std::ios_base::end) return seekpos(file_size + off, which);
+  return seekpos(off, which);
+}
+
+AsyncFileIStreamBuffer::pos_type AsyncFileIStreamBuffer::seekpos(pos_type pos, std::ios_base::openmode which) {
+  if (!(which & std::ios_base::in)) return pos_type(off_type(-1));
+  const long long target_pos = pos;
+  if (target_pos < 0 || target_pos > file_size) return pos_type(off_type(-1));
+  if (!read_ahead_stopped && target_pos >= get_area_offset && target_pos <= get_area_offset + (egptr() - eback())) {
+    setg(eback(), eback() + (target_pos - get_area_offset), egptr());
+    return target_pos;
+  }
+  // Whatever is still being read ahead is left to finish, it's only waited for if reading ahead is restarted
+  read_ahead_stopped = true;
+  read_offset = target_pos;
+  reads_since_seek = 0;
+  setg(nullptr, nullptr, nullptr);
+  return target_pos;
+}
+
+std::unique_ptr<std::istream> open_async_file_istream(const std::string& filename, bool direct_io) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  return std::make_unique<AsyncFileIStream>(fd, direct_io);
+}
+
+std::unique_ptr<std::ostream> open_async_file_ostream(const std::string& filename, bool direct_io) {
+  int fd = -1;
+#ifdef O_DIRECT
+  if (direct_io) {
+    fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+    // Some filesystems (like tmpfs) don't do O_DIRECT, we just write through the page cache on those
+    if (fd < 0 && errno != EINVAL) return nullptr;
+  }
+#endif
+  const bool is_direct = fd >= 0;
+  if (fd < 0) fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) return nullptr;
+  return std::make_unique<AsyncFileOStream>(fd, is_direct);
+}
+#endif
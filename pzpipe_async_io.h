@@ -0,0 +1,139 @@
+#ifndef PZPIPE_ASYNC_IO_H
+#define PZPIPE_ASYNC_IO_H
+#ifdef __unix
+#include <condition_variable>
+#include <deque>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+constexpr long long ASYNC_IO_BUFFER_SIZE = 1 << 20;
+constexpr unsigned int ASYNC_IO_QUEUE_DEPTH = 4;
+// O_DIRECT requires the buffers, file offsets and sizes of every request to be aligned to the device's logical block size,
+// 4KiB covers every device we are likely to find
+constexpr long long DIRECT_IO_ALIGNMENT = 4096;
+
+class AsyncIOBufferDeleter
+{
+public:
+  void operator()(char* buf) const;
+};
+// Always aligned to DIRECT_IO_ALIGNMENT, so any of them can be used with O_DIRECT
+using AsyncIOBuffer = std::unique_ptr<char[], AsyncIOBufferDeleter>;
+AsyncIOBuffer make_async_io_buffer(long long size);
+
+// Keeps reads or writes of a set of buffers in flight while the caller works on other buffers. Each buffer has at most one request
+// pending at a time, which is identified by the buffer's index.
+class AsyncFileIO
+{
+public:
+  virtual ~AsyncFileIO() = default;
+
+  virtual void submit_read(unsigned int buffer_index, char* buf, long long size, long long offset) = 0;
+  virtual void submit_write(unsigned int buffer_index, const char* buf, long long size, long long offset) = 0;
+  // Waits for the buffer's pending request (if any), returns the amount read/written or a negative errno
+  virtual long long wait(unsigned int buffer_index) = 0;
+
+  // io_uring if built with PZPIPE_IO_URING and the running kernel allows it, a few threads doing pread/pwrite otherwise.
+  // The buffers must be ASYNC_IO_BUFFER_SIZE bytes each, io_uring registers them with the kernel.
+  static std::unique_ptr<AsyncFileIO> create(int fd, const std::vector<AsyncIOBuffer>& buffers);
+};
+
+// Output file that is written behind the caller, ASYNC_IO_QUEUE_DEPTH buffers of ASYNC_IO_BUFFER_SIZE rotate so the caller only waits
+// when it wants to fill a buffer whose write hasn't finished yet.
+// If the fd was opened with O_DIRECT then direct_io must be set, so only whole aligned blocks are written, the last one padded with
+// zeros which are truncated away when closing.
+class AsyncFileOStreamBuffer : public std::streambuf
+{
+public:
+  AsyncFileOStreamBuffer(int fd, bool direct_io);
+  ~AsyncFileOStreamBuffer() override;
+
+protected:
+  int overflow(int c) override;
+  // Waits until everything written so far is on the file, returns -1 if any write failed
+  int sync() override;
+
+private:
+  int fd;
+  bool direct_io;
+  std::vector<AsyncIOBuffer> buffers;
+  std::vector<long long> pending_sizes;  // size of each buffer's pending write, 0 if there is none
+  std::vector<long long> pending_offsets;
+  std::unique_ptr<AsyncFileIO> async_io;
+  unsigned int curr_buffer = 0;
+  long long file_offset = 0;
+  bool write_failed = false;
+
+  void submit_current(bool final = false);
+  void write_unaligned_tail();
+  void wait_buffer(unsigned int buffer_index);
+};
+
+// Input file that is read ahead of the caller, ASYNC_IO_QUEUE_DEPTH reads of ASYNC_IO_BUFFER_SIZE are kept in flight.
+// With drop_page_cache the OS is told to evict each buffer's data from the page cache once it was consumed.
+// Reading ahead stops on seeks, the reads right after one are done synchronously for just the requested bytes, so hopping between
+// block headers (as ZpaqIStreamBuffer's block index does) doesn't read the whole file. It's restarted once reads are sequential again.
+class AsyncFileIStreamBuffer : public std::streambuf
+{
+public:
+  AsyncFileIStreamBuffer(int fd, bool drop_page_cache);
+  ~AsyncFileIStreamBuffer() override;
+
+protected:
+  int underflow() override;
+  std::streamsize xsgetn(char* s, std::streamsize n) override;
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+  // Synchronous reads after a seek before reading ahead again, enough for a block header and the block itself
+  static constexpr unsigned int READS_BEFORE_READ_AHEAD = 2;
+
+  int fd;
+  bool drop_page_cache;
+  long long file_size = 0;
+  std::vector<AsyncIOBuffer> buffers;
+  std::vector<long long> buffer_offsets;  // file offset each buffer was (or is being) read from, -1 if it has no read pending
+  std::unique_ptr<AsyncFileIO> async_io;
+  unsigned int curr_buffer = 0;
+  long long get_area_offset = 0;  // file offset of eback()
+  long long next_read_offset = 0;
+  // Set by seeks, while it is the get area is empty and reads are done synchronously from read_offset
+  bool read_ahead_stopped = true;
+  long long read_offset = 0;
+  unsigned int reads_since_seek = 0;
+
+  void submit_read(unsigned int buffer_index);
+  void restart_read_ahead(long long offset);
+};
+
+class AsyncFileOStream : public std::ostream
+{
+public:
+  AsyncFileOStream(int fd, bool direct_io) : std::ostream(nullptr), streambuf(fd, direct_io) { rdbuf(&streambuf); }
+
+private:
+  AsyncFileOStreamBuffer streambuf;
+};
+
+class AsyncFileIStream : public std::istream
+{
+public:
+  AsyncFileIStream(int fd, bool drop_page_cache) : std::istream(nullptr), streambuf(fd, drop_page_cache) { rdbuf(&streambuf); }
+
+private:
+  AsyncFileIStreamBuffer streambuf;
+};
+
+// Return nullptr if the file can't be opened. With direct_io the output file is opened with O_DIRECT if the filesystem supports it,
+// and the input file's data is dropped from the page cache as it's consumed, so neither of them pushes other things out of it.
+std::unique_ptr<std::istream> open_async_file_istream(const std::string& filename, bool direct_io = false);
+std::unique_ptr<std::ostream> open_async_file_ostream(const std::string& filename, bool direct_io = false);
+#endif
+#endif // PZPIPE_ASYNC_IO_H
@@ -0,0 +1,210 @@
+#include "pzpipe_c.h"
+#include "pzpipe_lib.h"
+
+#include <thread>
+
+// Hands everything written to it to the caller's write callback, big writes (whole blocks) are passed through without buffering
+class CallbackOStreamBuffer : public std::streambuf
+{
+public:
+  CallbackOStreamBuffer(pzpipe_write_fn write_fn, void* opaque) : write_fn(write_fn), opaque(opaque) {
+    setp(buffer, buffer + sizeof(buffer));
+  }
+
+  // The last bits of the stream (like the end of stream block header) might still be here if the compressor wasn't finished
+  ~CallbackOStreamBuffer() override { sync(); }
+
+protected:
+  int overflow(int c) override {
+    if (sync() != 0) return EOF;
+    if (c != EOF) {
+      *pptr() = static_cast<char>(c);
+      pbump(1);
+    }
+    return c == EOF ? 0 : c;
+  }
+
+  int sync() override {
+    const auto size = pptr() - pbase();
+    if (size > 0 && write_fn(opaque, pbase(), size) != 0) return -1;
+    setp(buffer, buffer + sizeof(buffer));
+    return 0;
+  }
+
+  std::streamsize xsputn(const char* s, std::streamsize n) override {
+    if (n < static_cast<std::streamsize>(sizeof(buffer))) return std::streambuf::xsputn(s, n);
+    if (sync() != 0 || write_fn(opaque, s, n) != 0) return 0;
+    return n;
+  }
+
+private:
+  pzpipe_write_fn write_fn;
+  void* opaque;
+  char buffer[4096];  // only for block headers and such
+};
+
+// Gets its data from the caller's read callback, big reads (whole compressed blocks) go straight to the destination
+class CallbackIStreamBuffer : public std::streambuf
+{
+public:
+  CallbackIStreamBuffer(pzpipe_read_fn read_fn, void* opaque) : read_fn(read_fn), opaque(opaque) {
+    setg(buffer, buffer, buffer);
+  }
+
+protected:
+  int underflow() override {
+    if (gptr() < egptr()) return static_cast<unsigned char>(*gptr());
+    const auto amt = read_fn(opaque, buffer, sizeof(buffer));
+    if (amt <= 0) {
+      if (amt < 0) throw std::runtime_error("can't read input");
+      return EOF;
+    }
+    setg(buffer, buffer, buffer + amt);
+    return static_cast<unsigned char>(*gptr());
+  }
+
+  std::streamsize xsgetn(char* s, std::streamsize n) override {
+    std::streamsize amt_read = std::min<std::streamsize>(n, egptr() - gptr());
+    memcpy(s, gptr(), amt_read);
+    gbump(static_cast<int>(amt_read));
+    if (n - amt_read < static_cast<std::streamsize>(sizeof(buffer))) return amt_read + std::streambuf::xsgetn(s + amt_read, n - amt_read);
+    while (amt_read < n) {
+      const auto amt = read_fn(opaque, s + amt_read, n - amt_read);
+      if (amt < 0) throw std::runtime_error("can't read input");
+      if (amt == 0) break;
+      amt_read += amt;
+    }
+    return amt_read;
+  }
+
+private:
+  pzpipe_read_fn read_fn;
+  void* opaque;
+  char buffer[4096];  // only for block headers and such
+};
+
+template <typename T, typename StreamBufT, typename FnT>
+class CallbackStream : public T
+{
+public:
+  CallbackStream(FnT fn, void* opaque) : T(nullptr), streambuf(fn, opaque) { this->rdbuf(&streambuf); }
+
+private:
+  StreamBufT streambuf;
+};
+
+struct pzpipe_pool
+{
+  std::shared_ptr<ZpaqWorkerPool> worker_pool;
+};
+
+struct pzpipe_compressor
+{
+  std::unique_ptr<ZpaqStreamCompressor> compressor;
+  std::string error;
+};
+
+struct pzpipe_decompressor
+{
+  std::unique_ptr<ZpaqStreamDecompressor> decompressor;
+  std::string error;
+};
+
+static std::shared_ptr<ZpaqWorkerPool> get_worker_pool(const pzpipe_pool* pool) {
+  if (pool != nullptr) return pool->worker_pool;
+  const unsigned int thread_count = std::max<unsigned int>(std::thread::hardware_concurrency(), 1);
+  return std::make_shared<ZpaqWorkerPool>(thread_count, thread_count);
+}
+
+pzpipe_pool* pzpipe_pool_create(unsigned int thread_count, long long memory_limit) {
+  try {
+    if (thread_count == 0) thread_count = std::max<unsigned int>(std::thread::hardware_concurrency(), 1);
+    return new pzpipe_pool { std::make_shared<ZpaqWorkerPool>(thread_count, thread_count, memory_limit) };
+  }
+  catch (...) {
+    return nullptr;
+  }
+}
+
+void pzpipe_pool_free(pzpipe_pool* pool) {
+  delete pool;
+}
+
+pzpipe_compressor* pzpipe_compressor_create(pzpipe_pool* pool, long long chunk_size, const char* method, pzpipe_write_fn write, void* opaque) {
+  if (write == nullptr) return nullptr;
+  if (chunk_size == 0) chunk_size = DEFAULT_CHUNK_SIZE;
+  try {
+    // Invalid chunk sizes or methods throw here, see validate_compression_settings()
+    auto output = std::make_unique<CallbackStream<std::ostream, CallbackOStreamBuffer, pzpipe_write_fn>>(write, opaque);
+    return new pzpipe_compressor {
+      std::make_unique<ZpaqStreamCompressor>(std::move(output), get_worker_pool(pool), chunk_size, method != nullptr ? method : ""), ""
+    };
+  }
+  catch (...) {
+    return nullptr;
+  }
+}
+
+int pzpipe_compressor_feed(pzpipe_compressor* compressor, const void* data, size_t size) {
+  if (!compressor->error.empty()) return -1;
+  try {
+    compressor->compressor->push(static_cast<const char*>(data), static_cast<long long>(size));
+    return 0;
+  }
+  catch (const std::exception& e) {
+    compressor->error = e.what();
+    return -1;
+  }
+}
+
+int pzpipe_compressor_finish(pzpipe_compressor* compressor) {
+  if (!compressor->error.empty()) return -1;
+  try {
+    compressor->compressor->finish();
+    return 0;
+  }
+  catch (const std::exception& e) {
+    compressor->error = e.what();
+    return -1;
+  }
+}
+
+const char* pzpipe_compressor_error(const pzpipe_compressor* compressor) {
+  return compressor->error.c_str();
+}
+
+void pzpipe_compressor_free(pzpipe_compressor* compressor) {
+  delete compressor;
+}
+
+pzpipe_decompressor* pzpipe_decompressor_create(pzpipe_pool* pool, pzpipe_read_fn read, void* opaque) {
+  if (read == nullptr) return nullptr;
+  try {
+    auto input = std::make_unique<CallbackStream<std::istream, CallbackIStreamBuffer, pzpipe_read_fn>>(read, opaque);
+    // So a failed read callback gets reported as such, instead of the istream swallowing it and the block looking truncated
+    input->exceptions(std::ios_base::badbit);
+    return new pzpipe_decompressor { std::make_unique<ZpaqStreamDecompressor>(std::move(input), get_worker_pool(pool)), "" };
+  }
+  catch (...) {
+    return nullptr;
+  }
+}
+
+long long pzpipe_decompressor_read(pzpipe_decompressor* decompressor, void* buf, size_t size) {
+  if (!decompressor->error.empty()) return -1;
+  try {
+    return decompressor->decompressor->pull(static_cast<char*>(buf), static_cast<long long>(size));
+  }
+  catch (const std::exception& e) {
+    decompressor->error = e.what();
+    return -1;
+  }
+}
+
+const char* pzpipe_decompressor_error(const pzpipe_decompressor* decompressor) {
+  return decompressor->error.c_str();
+}
+
+void pzpipe_decompressor_free(pzpipe_decompressor* decompressor) {
+  delete decompressor;
+}
@@ -0,0 +1,67 @@
+#ifndef PZPIPE_C_H
+#define PZPIPE_C_H
+/*
+ * C interface to pzpipe's multithreaded ZPAQ (de)compression, for using it from other languages through libpzpipe.
+ * The compressed data is the raw block stream of pzpipe_lib.h (no pzpipe CLI header), and it goes through callbacks so blocks are handed
+ * over straight from the engine's buffers. Uncompressed data always goes through buffers owned by the caller.
+ * Functions returning int return 0 on success and -1 on error, in which case pzpipe_*_error() tells what went wrong.
+ * A context must only be used by one thread at a time, but any number of contexts can be used concurrently.
+ */
+#include <stddef.h>
+
+#if defined(_WIN32)
+# ifdef PZPIPE_BUILDING_SHARED
+#  define PZPIPE_API __declspec(dllexport)
+# else
+#  define PZPIPE_API
+# endif
+#else
+# define PZPIPE_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct pzpipe_pool pzpipe_pool;
+typedef struct pzpipe_compressor pzpipe_compressor;
+typedef struct pzpipe_decompressor pzpipe_decompressor;
+
+/* Called with each piece of compressed output, from one of the engine's threads. Return 0 on success, anything else fails the stream. */
+typedef int (*pzpipe_write_fn)(void* opaque, const void* data, size_t size);
+/* Called to get more compressed input, return the amount copied to buf (0 at the end of the input) or -1 on error. */
+typedef long long (*pzpipe_read_fn)(void* opaque, void* buf, size_t size);
+
+/*
+ * Worker threads that any number of contexts can share. thread_count 0 uses one per core, memory_limit 0 means no limit.
+ * The pool can be freed while contexts still use it, it goes away along with the last of them.
+ */
+PZPIPE_API pzpipe_pool* pzpipe_pool_create(unsigned int thread_count, long long memory_limit);
+PZPIPE_API void pzpipe_pool_free(pzpipe_pool* pool);
+
+/*
+ * pool can be NULL for the context to get its own. chunk_size 0 uses the default, method NULL or "" uses the built-in model, otherwise
+ * it's a libzpaq method like the pzpipe CLI's -m. Returns NULL if the arguments are invalid: a chunk size out of bounds, or a method
+ * libzpaq rejects or whose block size is too small for the chunk size (same checks as the CLI).
+ */
+PZPIPE_API pzpipe_compressor* pzpipe_compressor_create(
+  pzpipe_pool* pool, long long chunk_size, const char* method, pzpipe_write_fn write, void* opaque
+);
+/* Blocks while the workers are behind */
+PZPIPE_API int pzpipe_compressor_feed(pzpipe_compressor* compressor, const void* data, size_t size);
+/* Compresses what's left, when this returns every block (and the end of stream) was passed to the write callback */
+PZPIPE_API int pzpipe_compressor_finish(pzpipe_compressor* compressor);
+PZPIPE_API const char* pzpipe_compressor_error(const pzpipe_compressor* compressor);
+PZPIPE_API void pzpipe_compressor_free(pzpipe_compressor* compressor);
+
+/* pool can be NULL for the context to get its own */
+PZPIPE_API pzpipe_decompressor* pzpipe_decompressor_create(pzpipe_pool* pool, pzpipe_read_fn read, void* opaque);
+/* Returns the amount copied to buf, only less than size at the end of the stream, or -1 on error */
+PZPIPE_API long long pzpipe_decompressor_read(pzpipe_decompressor* decompressor, void* buf, size_t size);
+PZPIPE_API const char* pzpipe_decompressor_error(const pzpipe_decompressor* decompressor);
+PZPIPE_API void pzpipe_decompressor_free(pzpipe_decompressor* decompressor);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* PZPIPE_C_H */
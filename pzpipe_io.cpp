@@ -1,5 +1,20 @@
 #include "pzpipe_io.h"
 
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __unix
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+
 template <typename T>
 class PZPipe_OStream : public T
 {
@@ -12,23 +27,395 @@ public:
     stream_ref.rdbuf(streambuffer);
   }
 
+  // Callers that want to know if the stream failed need to call set_stream_eof() themselves before this
   ~PZPipe_OStream() {
-    if (otf_compression_streambuf != nullptr) otf_compression_streambuf->set_stream_eof();
+    if (otf_compression_streambuf == nullptr) return;
+    try {
+      otf_compression_streambuf->set_stream_eof();
+    }
+    catch (...) {}
   }
 };
 
-std::unique_ptr<std::istream> wrap_istream_otf_compression(std::unique_ptr<std::istream>&& istream, unsigned int max_thread_count) {
-  return ZpaqIStreamBuffer::from_istream(std::move(istream), max_thread_count);
+std::unique_ptr<std::istream> wrap_istream_otf_compression(
+  std::unique_ptr<std::istream>&& istream, unsigned int max_thread_count, long long chunk_size, double memory_limit
+) {
+  return ZpaqIStreamBuffer::from_istream(std::move(istream), max_thread_count, chunk_size, memory_limit);
 }
 
-void libzpaq::error(const char* msg) {  // print message and exit
-  fprintf(stderr, "Oops: %s\n", msg);
-  exit(1);
+void validate_compression_settings(const std::string& method, long long chunk_size) {
+  if (chunk_size < MIN_CHUNK_SIZE || chunk_size > MAX_CHUNK_SIZE) {
+    throw std::runtime_error(
+      "chunk size must be between " + std::to_string(MIN_CHUNK_SIZE >> 10) + "K and " + std::to_string(MAX_CHUNK_SIZE >> 20) + "M"
+    );
+  }
+  if (method.empty()) return;
+  if (!isdigit(method[0]) && method[0] != 'x' && method[0] != 's') {
+    throw std::runtime_error("compression method must be a level 0-5 (\"LB,R,t\") or a \"x...\"/\"s...\" config");
+  }
+  if (!isdigit(method[0])) {
+    // Explicit configs set the block size themselves as their first argument (log2 of the size in MiB), which has to fit a whole chunk
+    const int log_block_size = isdigit(method[1]) ? atoi(method.c_str() + 1) : 0;
+    if (log_block_size > 11 || (0x100000LL << log_block_size) - 4096 < chunk_size) {
+      throw std::runtime_error("compression method block size too small for a " + std::to_string(chunk_size) + " bytes chunk size");
+    }
+  }
+
+  libzpaq::StringBuffer test_input;
+  libzpaq::StringBuffer test_output;
+  test_input.put(0);
+  libzpaq::compressBlock(&test_input, &test_output, method.c_str(), nullptr, nullptr, false);
+}
+
+void write_block_header(std::ostream& ostream, const ZpaqBlockHeader& block_header) {
+  char header_bytes[BLOCK_HEADER_SIZE];
+  for (int i = 0; i < 4; i++) {
+    header_bytes[i] = static_cast<char>((block_header.compressed_size >> (i * 8)) & 0xFF);
+    header_bytes[i + 4] = static_cast<char>((block_header.uncompressed_size >> (i * 8)) & 0xFF);
+  }
+  ostream.write(header_bytes, BLOCK_HEADER_SIZE);
+}
+
+bool read_block_header(std::istream& istream, ZpaqBlockHeader& block_header) {
+  unsigned char header_bytes[BLOCK_HEADER_SIZE];
+  istream.read(reinterpret_cast<char*>(header_bytes), BLOCK_HEADER_SIZE);
+  if (istream.gcount() == 0) return false;
+  if (istream.gcount() != BLOCK_HEADER_SIZE) libzpaq::error("unexpected end of file");
+  block_header.compressed_size = 0;
+  block_header.uncompressed_size = 0;
+  for (int i = 3; i >= 0; i--) {
+    block_header.compressed_size = (block_header.compressed_size << 8) | header_bytes[i];
+    block_header.uncompressed_size = (block_header.uncompressed_size << 8) | header_bytes[i + 4];
+  }
+  return true;
+}
+
+BlockAnalysis::BlockAnalysis(const unsigned char* data, long long size) {
+  if (size <= 0) return;
+  long long counts[256] = {};
+  unsigned char order1_predictions[256] = {};
+  long long order1_hits = 0;
+  // Distances to the previous occurrence of each byte, as compressBlock itself does at levels 5+ to add periodic models
+  constexpr int MAX_PERIOD = 1 << 12;
+  std::vector<long long> repeat_distances(MAX_PERIOD);
+  long long last_positions[256] = {};
+  long long text_bytes = 0;
+  long long x86_calls = 0;
+  unsigned char prev = 0;
+  for (long long i = 0; i < size; i++) {
+    const unsigned char c = data[i];
+    counts[c]++;
+    if (order1_predictions[prev] == c) order1_hits++;
+    order1_predictions[prev] = c;
+    prev = c;
+    const long long distance = i - last_positions[c];
+    if (distance > 0 && distance < MAX_PERIOD) repeat_distances[distance]++;
+    last_positions[c] = i;
+    if ((c >= 32 && c < 127) || c == '\n' || c == '\r' || c == '\t') text_bytes++;
+    // CALL/JMP rel32, whose offsets are mostly small positive or negative numbers so their last byte is 0x00 or 0xFF
+    if ((c == 0xE8 || c == 0xE9) && i + 4 < size && (data[i + 4] == 0x00 || data[i + 4] == 0xFF)) x86_calls++;
+  }
+
+  double entropy = 0;
+  for (const long long count : counts) {
+    if (count > 0) entropy -= count * std::log2(static_cast<double>(count) / size);
+  }
+  const double order0_savings = 1 - entropy / size / 8;
+  // Distance 1 are runs of the same byte, which order 1 already accounts for
+  const double period_hits = *std::max_element(repeat_distances.begin() + 2, repeat_distances.end());
+  const double predictability = std::max({ order0_savings, static_cast<double>(order1_hits) / size, period_hits / size });
+  redundancy = std::clamp(static_cast<int>(predictability * 256), 0, 255);
+  is_text = text_bytes >= size - size / 10;
+  is_exe = x86_calls * 256 > size;
+}
+
+bool BlockAnalysis::has_long_range_repeats(const unsigned char* data, long long size) {
+  // Anchors are the positions of a single byte value, about 1 in 256 anywhere in data that looks incompressible, and a repeat has
+  // its anchors in the same places. memchr finds them at about memory bandwidth and only the 32 bytes following each are hashed.
+  constexpr unsigned char ANCHOR_BYTE = 0xA5;
+  constexpr long long WINDOW_SIZE = 32;
+  if (size <= WINDOW_SIZE) return false;
+  std::unordered_set<uint64_t> window_hashes;
+  window_hashes.reserve(size / 128);
+  long long anchors = 0;
+  long long repeated_anchors = 0;
+  const unsigned char* const end = data + size - WINDOW_SIZE;
+  for (auto anchor = static_cast<const unsigned char*>(memchr(data, ANCHOR_BYTE, end - data)); anchor != nullptr;
+       anchor = anchor + 1 < end ? static_cast<const unsigned char*>(memchr(anchor + 1, ANCHOR_BYTE, end - anchor - 1)) : nullptr) {
+    uint64_t hash = 0;
+    for (long long i = 0; i < WINDOW_SIZE; i += 8) {
+      uint64_t word;
+      memcpy(&word, anchor + i, 8);
+      hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+      hash ^= hash >> 32;
+    }
+    anchors++;
+    if (!window_hashes.insert(hash).second) repeated_anchors++;
+  }
+  // Repeats covering less than 1/32 of the block aren't worth giving up storing it for
+  return repeated_anchors * 32 > anchors;
 }
 
-std::unique_ptr<std::ostream> ZpaqOStreamBuffer::from_ostream(std::unique_ptr<std::ostream>&& ostream, unsigned int max_thread_count) {
+std::string BlockAnalysis::complete_method(const std::string& bare_level) const {
+  return bare_level + "," + std::to_string(redundancy) + "," + std::to_string((is_text ? 1 : 0) | (is_exe ? 2 : 0));
+}
+
+#ifdef __unix
+MappedFile::MappedFile(const std::string& filename, bool drop_page_cache) : drop_page_cache(drop_page_cache) {
+  fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  struct stat file_stat {};
+  if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0) {
+    void* mapping = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+      // Each worker reads its own block sequentially, so aggressive readahead is what we want
+      madvise(mapping, file_stat.st_size, MADV_SEQUENTIAL);
+      mapped_data = static_cast<const char*>(mapping);
+      mapped_size = file_stat.st_size;
+    }
+  }
+  // The mapping stays valid after closing its fd, we only keep it around to drop the page cache
+  if (mapped_data == nullptr || !drop_page_cache) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (mapped_data != nullptr) munmap(const_cast<char*>(mapped_data), mapped_size);
+  if (fd >= 0) close(fd);
+}
+
+void MappedFile::release_range(long long offset, long long size) const {
+  const auto page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  const auto range_data = mapped_data + offset;
+  const auto range_start = (reinterpret_cast<uintptr_t>(range_data) + page_size - 1) & ~(page_size - 1);
+  const auto range_end = (reinterpret_cast<uintptr_t>(range_data) + size) & ~(page_size - 1);
+  if (range_end > range_start) madvise(reinterpret_cast<void*>(range_start), range_end - range_start, MADV_DONTNEED);
+  // Unmapping the pages only means we don't use them anymore, they stay in the page cache unless we ask for them to be evicted
+  if (drop_page_cache) posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
+}
+#else
+MappedFile::MappedFile(const std::string& filename, bool drop_page_cache) : drop_page_cache(drop_page_cache) {}
+MappedFile::~MappedFile() = default;
+void MappedFile::release_range(long long offset, long long size) const {}
+#endif
+
+std::streamsize CompressedOStreamBuffer::ingest(const MappedFile& file, long long offset, long long size) {
+  if (pptr() == epptr()) {
+    sync();
+  }
+  if (pptr() > pbase()) {
+    const auto amt = std::min<long long>(size, epptr() - pptr());
+    memcpy(pptr(), file.data() + offset, amt);
+    pbump(static_cast<int>(amt));
+    return amt;
+  }
+  const auto amt = std::min<long long>(size, chunk_size);
+  compress_mapped_block(file, offset, amt);
+  return amt;
+}
+
+std::streamsize CompressedOStreamBuffer::ingest(const PositionalFile& file, long long offset, long long size) {
+  if (pptr() == epptr()) {
+    sync();
+  }
+  if (pptr() > pbase()) {
+    const auto amt = file.read_at(pptr(), std::min<long long>(size, epptr() - pptr()), offset);
+    pbump(static_cast<int>(amt));
+    return amt;
+  }
+  const auto amt = std::min<long long>(size, chunk_size);
+  compress_positional_block(file, offset, amt);
+  return amt;
+}
+
+#ifdef __unix
+PositionalFile::PositionalFile(const std::string& filename, bool drop_page_cache) : drop_page_cache(drop_page_cache) {
+  fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  struct stat file_stat {};
+  if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+    close(fd);
+    fd = -1;
+    return;
+  }
+  file_size = file_stat.st_size;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+PositionalFile::~PositionalFile() {
+  if (fd >= 0) close(fd);
+}
+
+bool PositionalFile::is_open() const { return fd >= 0; }
+
+void PositionalFile::release_range(long long offset, long long size) const {
+  if (drop_page_cache) posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
+}
+
+long long PositionalFile::read_at(char* buf, long long size, long long offset) const {
+  long long total_read = 0;
+  while (total_read < size) {
+    const auto amt = pread(fd, buf + total_read, size - total_read, offset + total_read);
+    if (amt < 0 && errno == EINTR) continue;
+    if (amt <= 0) break;
+    total_read += amt;
+  }
+  return total_read;
+}
+#else
+PositionalFile::PositionalFile(const std::string& filename, bool drop_page_cache) : drop_page_cache(drop_page_cache) {
+  handle = CreateFileA(
+    filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr
+  );
+  LARGE_INTEGER size;
+  if (handle != INVALID_HANDLE_VALUE && GetFileType(handle) == FILE_TYPE_DISK && GetFileSizeEx(handle, &size)) {
+    file_size = size.QuadPart;
+  }
+  else if (handle != INVALID_HANDLE_VALUE) {
+    CloseHandle(handle);
+    handle = INVALID_HANDLE_VALUE;
+  }
+}
+
+PositionalFile::~PositionalFile() {
+  if (handle != INVALID_HANDLE_VALUE) CloseHandle(handle);
+}
+
+bool PositionalFile::is_open() const { return handle != INVALID_HANDLE_VALUE; }
+
+void PositionalFile::release_range(long long offset, long long size) const {}
+
+long long PositionalFile::read_at(char* buf, long long size, long long offset) const {
+  long long total_read = 0;
+  while (total_read < size) {
+    // With an OVERLAPPED offset ReadFile doesn't use (or move) the handle's file position, so this is safe to call from many threads
+    OVERLAPPED overlapped {};
+    overlapped.Offset = static_cast<DWORD>((offset + total_read) & 0xFFFFFFFF);
+    overlapped.OffsetHigh = static_cast<DWORD>((offset + total_read) >> 32);
+    DWORD amt = 0;
+    const auto to_read = static_cast<DWORD>(std::min<long long>(size - total_read, 1 << 30));
+    if (!ReadFile(handle, buf + total_read, to_read, &amt, &overlapped) || amt == 0) break;
+    total_read += amt;
+  }
+  return total_read;
+}
+#endif
+
+// Thrown from whichever thread hit it, workers hand it over to the stream the block belongs to
+void libzpaq::error(const char* msg) {
+  throw std::runtime_error(msg);
+}
+
+namespace libzpaq {
+  // Defined on libzpaq.cpp and used by compressBlock, just not declared on libzpaq.h
+  std::string makeConfig(const char* method, int args[]);
+}
+
+// Log block size ("x<arg0>...", blocks up to 2^(arg0 + 20) - 4096 bytes) compressBlock gives levels for a block of size
+static int log_block_size(long long size) {
+  int arg0 = 0;
+  while ((1LL << (arg0 + 20)) < size + 4096) arg0++;
+  return arg0;
+}
+
+// The same expansion compressBlock does of a "LB,R,t" method into a "x..." one for a block with the given log block size.
+// Level 5+ blocks might get up to two periodic models added depending on their data, both are assumed here as that's their worst case.
+static std::string expand_level_method(const std::string& method, int arg0) {
+  int commas = 0;
+  int arg[4] = {};
+  for (size_t i = 1; i < method.size() && commas < 4; i++) {
+    if (method[i] == ',' || method[i] == '.') commas++;
+    else if (isdigit(method[i])) arg[commas] = arg[commas] * 10 + method[i] - '0';
+  }
+  const int type = commas == 0 ? 512 : arg[1] * 4 + arg[2];
+  const int level = method[0] - '0';
+  const std::string doe8 = std::to_string((type & 2) * 2);
+  const std::string lz77 = std::to_string(1 + (type & 2) * 2);
+  const std::string htsz = "," + std::to_string(19 + arg0 + (arg0 <= 6));
+  const std::string sasz = "," + std::to_string(21 + arg0);
+  std::string expanded = "x" + std::to_string(arg0);
+  if (level == 0) return "0" + std::to_string(arg0) + ",0";
+  if (level == 1) {
+    if (type < 40) expanded += ",0";
+    else if (type < 80) expanded += "," + lz77 + ",4,0,1,15";
+    else if (type < 128) expanded += "," + lz77 + ",4,0,2,16";
+    else if (type < 256) expanded += "," + lz77 + ",4,0,2" + htsz;
+    else if (type < 960) expanded += "," + lz77 + ",5,0,3" + htsz;
+    else expanded += "," + lz77 + ",6,0,3" + htsz;
+  }
+  else if (level == 2) {
+    if (type < 32) expanded += ",0";
+    else if (type < 64) expanded += "," + lz77 + ",4,0,3" + htsz;
+    else expanded += "," + lz77 + ",4,0,7" + sasz + ",1";
+  }
+  else if (level == 3) {
+    if (type < 20) expanded += ",0";
+    else if (type < 48) expanded += "," + lz77 + ",4,0,3" + htsz;
+    else if (type >= 640 || (type & 1)) expanded += "," + std::to_string(3 + (type & 2) * 2) + "ci1";
+    else expanded += "," + std::to_string(2 + (type & 2) * 2) + ",12,0,7" + sasz + ",1c0,0,511i2";
+  }
+  else if (level == 4) {
+    if (type < 12) expanded += ",0";
+    else if (type < 24) expanded += "," + lz77 + ",4,0,3" + htsz;
+    else if (type < 48) expanded += "," + std::to_string(2 + (type & 2) * 2) + ",5,0,7" + sasz + "1c0,0,511";
+    else if (type < 900) expanded += "," + doe8 + "ci1,1,1,1,2a" + ((type & 1) ? "w" : "") + "m";
+    else expanded += "," + std::to_string(3 + (type & 2) * 2) + "ci1";
+  }
+  else {
+    expanded += "," + doe8 + ((type & 1) ? "w2c0,1010,255i1" : "w1i1") + "c256ci1,1,1,1,1,1,2a";
+    expanded += "c0,0,1254,255i1c0,255i1c0,0,1253,255i1c0,254i1";
+    expanded += "c0,2,0,255i1c0,3,0,0,255i1c0,4,0,0,0,255i1mm16ts19t0";
+  }
+  return expanded;
+}
+
+double ZpaqOStreamBuffer::estimate_block_memory(const std::string& method, long long chunk_size) {
+  if (BlockAnalysis::is_bare_level(method)) {
+    double memory = 0;
+    // The type thresholds compressBlock picks models at, each with every combination of the text and exe flags
+    for (const int redundancy : { 0, 3, 5, 6, 8, 10, 12, 16, 20, 32, 64, 160, 225, 240, 255 }) {
+      for (int flags = 0; flags < 4; flags++) {
+        const std::string typed_method = method + "," + std::to_string(redundancy) + "," + std::to_string(flags);
+        memory = std::max(memory, estimate_block_memory(typed_method, chunk_size));
+      }
+    }
+    return memory;
+  }
+
+  // Writing the block header is enough for a Decompresser to tell how much its models need, the models are only allocated once
+  // data is compressed
+  libzpaq::StringBuffer header;
+  libzpaq::Compressor compressor;
+  compressor.setOutput(&header);
+  compressor.writeTag();
+  int args[9] = {};
+  if (method.empty()) {
+    compressor.startBlock(2);
+  }
+  else {
+    // Levels get their log block size from the size of the block being compressed, "x..."/"s..." configs have it on the method.
+    // The component tables grow with it, so estimating from a tiny sample block would be way off for real ones.
+    const std::string expanded_method = isdigit(method[0]) ? expand_level_method(method, log_block_size(chunk_size)) : method;
+    const std::string config = libzpaq::makeConfig(expanded_method.c_str(), args);
+    libzpaq::StringBuffer pcomp_cmd;
+    compressor.startBlock(config.c_str(), args, &pcomp_cmd);
+  }
+  libzpaq::Decompresser decompresser;
+  decompresser.setInput(&header);
+  double memory;
+  decompresser.findBlock(&memory);
+  // compressBlock's LZ77/BWT preprocessing allocates a suffix array (4 bytes per input byte) and its output (1 byte per byte)
+  if ((args[1] & 3) != 0) memory += 5.0 * chunk_size;
+  return memory;
+}
+
+std::unique_ptr<std::ostream> ZpaqOStreamBuffer::from_ostream(
+  std::unique_ptr<std::ostream>&& ostream, unsigned int max_thread_count, long long chunk_size, const std::string& method, double memory_limit
+) {
   auto new_fout = new PZPipe_OStream<std::ofstream>();
-  auto zpaq_streambuf = new ZpaqOStreamBuffer(std::move(ostream), max_thread_count);
+  auto zpaq_streambuf = new ZpaqOStreamBuffer(std::move(ostream), max_thread_count, chunk_size, method, memory_limit);
   new_fout->otf_compression_streambuf = std::unique_ptr<ZpaqOStreamBuffer>(zpaq_streambuf);
   new_fout->rdbuf(zpaq_streambuf);
   return std::unique_ptr<std::ostream>(new_fout);
@@ -36,7 +423,10 @@ std::unique_ptr<std::ostream> ZpaqOStreamBuffer::from_ostream(std::unique_ptr<st
 
 std::unique_ptr<std::ostream> wrap_ostream_otf_compression(
   std::unique_ptr<std::ostream>&& ostream,
-  unsigned int compression_otf_thread_count
+  unsigned int compression_otf_thread_count,
+  long long chunk_size,
+  const std::string& method,
+  double memory_limit
 ) {
-  return ZpaqOStreamBuffer::from_ostream(std::move(ostream), compression_otf_thread_count);
+  return ZpaqOStreamBuffer::from_ostream(std::move(ostream), compression_otf_thread_count, chunk_size, method, memory_limit);
 }
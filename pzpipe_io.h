@@ -1,244 +1,449 @@
 #ifndef PZPIPE_IO_H
 #define PZPIPE_IO_H
-#include "pzpipe_utils.h"
+#include "pzpipe_workers.h"
 
 #include "contrib/zpaq/libzpaq.h"
 
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <exception>
 #include <memory>
 #include <fstream>
 #include <functional>
+#include <future>
+#include <map>
+#include <mutex>
 #include <queue>
-#include <thread>
+#include <stdexcept>
+#include <string>
 #include <utility>
 
 class CompressedOStreamBuffer;
-constexpr auto CHUNK = 262144 * 4 * 10; // 10 MB buffersize
+class PositionalFile;
+class MappedFile;
+// Each chunk of the input is compressed as an independent ZPAQ block, smaller chunks allow more parallelism but cost compression ratio,
+// as the ZPAQ context models restart on every block
+constexpr long long DEFAULT_CHUNK_SIZE = 262144 * 4 * 10; // 10 MB buffersize
+constexpr long long MIN_CHUNK_SIZE = 1 << 16;
+// Smallest chunk size picked automatically to spread an input across threads, below this the ratio loss outweighs the extra parallelism
+constexpr long long MIN_ADAPTIVE_CHUNK_SIZE = 1 << 20;
+constexpr long long MAX_CHUNK_SIZE = 1 << 30;
+
+// libzpaq only asserts on most invalid methods (or silently produces blocks that don't decompress), so check what we can beforehand
+// and do a test run to get any other error right away. Throws std::runtime_error if the chunk size is out of bounds or the method
+// can't compress chunks of that size, an empty method (the built-in model) is always valid.
+void validate_compression_settings(const std::string& method, long long chunk_size);
+
+// Each ZPAQ block on a PCF stream is preceded by its compressed and uncompressed sizes (32bit little endian each), so blocks can be
+// handed to the workers (or skipped over) without parsing them. A block header with a compressed size of 0 marks the end of the stream.
+// ZPAQ decompressors skip anything between blocks, so the stream is still readable by other ZPAQ tools.
+class ZpaqBlockHeader
+{
+public:
+  long long compressed_size;
+  long long uncompressed_size;
+};
+constexpr int BLOCK_HEADER_SIZE = 8;
+
+void write_block_header(std::ostream& ostream, const ZpaqBlockHeader& block_header);
+// Returns false if the istream is at EOF
+bool read_block_header(std::istream& istream, ZpaqBlockHeader& block_header);
+
+// Single pass statistics of a block's data, cheap next to compressing it, so the model can be picked for each block.
+// compressBlock already picks store, LZ77, BWT or CM from the "R,t" of an "LB,R,t" method, this is what fills them in.
+class BlockAnalysis
+{
+public:
+  // 0..255, how much of the block the simplest models could predict: the best of the order 0 entropy savings and the order 1 and
+  // repeating distance (periodic data like tables or audio samples) hit rates. Random or already compressed data gets close to 0.
+  int redundancy = 0;
+  bool is_text = false;
+  // x86 code, which the E8E9 transform helps with
+  bool is_exe = false;
+  // JPEG, xz or encrypted data gets 1-2 here, zip files with their headers and filenames about 4
+  static constexpr int INCOMPRESSIBLE_REDUNDANCY = 4;
+
+  BlockAnalysis(const unsigned char* data, long long size);
+
+  // Not worth modeling, any model would spend its time on every bit to end up bigger than the data, so it's better off stored.
+  // Only as far as these statistics can tell, see has_long_range_repeats().
+  [[nodiscard]] bool is_incompressible() const { return redundancy < INCOMPRESSIBLE_REDUNDANCY; }
+
+  // Repeats further apart than the periods looked at (like the same file twice in a block) don't show up in the statistics at all.
+  // Probes a sparse set of positions for them, at about the cost of reading the block once.
+  static bool has_long_range_repeats(const unsigned char* data, long long size);
+
+  // A level without the rest of "LB,R,t" (as in -m1..-m5), so each block's type can come from its own data instead of libzpaq's default
+  static bool is_bare_level(const std::string& method) { return !method.empty() && isdigit(method[0]) && method.find_first_of(",.") == std::string::npos; }
+  [[nodiscard]] std::string complete_method(const std::string& bare_level) const;
+};
 
 class ZpaqIStreamBuffer : public std::streambuf
 {
+  // Reads a single, complete, compressed block
   class ZpaqIStreamBufReader : public libzpaq::Reader
   {
   public:
     std::vector<char> otf_in;
-    std::istream* streambuf_wrapped_istream;
     long long curr_read_slot = 0;
-    long long eof_slot = -1;
-
-    explicit ZpaqIStreamBufReader(std::istream* wrapped_istream) : streambuf_wrapped_istream(wrapped_istream) {}
 
-    explicit ZpaqIStreamBufReader(std::vector<char>&& otf_in)
-      : otf_in(std::move(otf_in)), streambuf_wrapped_istream(nullptr), eof_slot(this->otf_in.size()) {}
-
-    // Using this indirect way of getting pointers to the vector using slot to ensure we don't have problems after memory reallocations
-    char* curr_read_ptr()
-    {
-      return otf_in.empty() ? nullptr : otf_in.data() + curr_read_slot;
-    }
+    explicit ZpaqIStreamBufReader(std::vector<char>&& otf_in) : otf_in(std::move(otf_in)) {}
 
-    char* eof_ptr()
-    {
-      return eof_slot < 0 ? nullptr : otf_in.data() + eof_slot;
+    // libzpaq's Decoder reads in 64Kb chunks through here, so we want to avoid having it go through get() for each byte
+    int read(char* buf, int n) override {
+      const auto read_size = std::min<long long>(n, otf_in.size() - curr_read_slot);
+      memcpy(buf, otf_in.data() + curr_read_slot, read_size);
+      curr_read_slot += read_size;
+      return read_size;
     }
 
     int get() override {
-      if (curr_read_ptr() != nullptr && curr_read_ptr() == eof_ptr()) return EOF;
-      if (curr_read_ptr() == nullptr || curr_read_ptr() == otf_in.data() + otf_in.size()) {
-        otf_in.reserve(otf_in.capacity() + CHUNK);
-        if (curr_read_ptr() == nullptr) curr_read_slot = 0;
-
-        auto tmp_buf = std::make_unique<char[]>(CHUNK);
-        streambuf_wrapped_istream->read(tmp_buf.get(), CHUNK);
-        const auto read_count = streambuf_wrapped_istream->gcount();
-
-        if (read_count < CHUNK) eof_slot = curr_read_slot + read_count;
-        if (read_count == 0) return EOF;
-
-        for (char* curr = tmp_buf.get(); curr < tmp_buf.get() + read_count; curr++)
-        {
-          otf_in.push_back(*curr);
-        }
-      }
-      const auto chr = static_cast<unsigned char>(*curr_read_ptr());
+      if (curr_read_slot == static_cast<long long>(otf_in.size())) return EOF;
+      const auto chr = static_cast<unsigned char>(otf_in[curr_read_slot]);
       curr_read_slot++;
       return chr;
     }
+  };
 
-    std::vector<char> buffer_discard_old_data() {
-      const char* data_end_ptr = eof_ptr() != nullptr ? eof_ptr() : otf_in.data() + otf_in.size();
-      // ZPAQ uses a 64Kb buffer, so the actual start of the next block might be as far as 64Kb before the current reading position
-      const char* data_start_ptr = curr_read_ptr() - (1 << 16) < otf_in.data() ? otf_in.data() : curr_read_ptr() - (1 << 16);
-      const long long remaining_data_size = data_end_ptr - data_start_ptr;
-      // copy the remaining data to a new vector
-      std::vector<char> new_otf_in{};
-      if (remaining_data_size > 0) new_otf_in.reserve(CHUNK);
-      for (const char* curr = data_start_ptr; curr < data_end_ptr; curr++)
-      {
-        new_otf_in.push_back(*curr);
-      }
-      new_otf_in.swap(otf_in); // replace the old vector and free/transfer its memory (as its going out of scope/getting returned next)
-      new_otf_in.resize(curr_read_slot);
-      new_otf_in.shrink_to_fit();
-
-      if (eof_ptr() != nullptr)  // adjust eof if necessary
-      {
-        eof_slot = eof_ptr() - data_start_ptr;  // remaining data before eof
-      }
-      curr_read_slot = 0;
-      return new_otf_in;
-    }
+  class ZpaqDecBuffer
+  {
+  public:
+    std::unique_ptr<char[]> data;
+    long long capacity = 0;
   };
 
+  // Writes the decompressed block to a buffer sized from the block header, if the block turns out to be bigger than that
+  // (corrupt or crafted header) the buffer grows instead of overflowing
   class ZpaqIStreamBufWriter : public libzpaq::Writer
   {
   public:
-    std::unique_ptr<char[]>* dec_buf;
-    char* curr_write = nullptr;
+    ZpaqDecBuffer dec_buf;
+    long long written = 0;
 
-    explicit ZpaqIStreamBufWriter(std::unique_ptr<char[]>* otf_dec) : dec_buf(otf_dec) {}
+    explicit ZpaqIStreamBufWriter(ZpaqDecBuffer&& dec_buf) : dec_buf(std::move(dec_buf)) {}
 
     void put(int c) override {
-      if (curr_write == nullptr) reset_write_ptr();
-      *curr_write = c;
-      curr_write++;
+      if (written == dec_buf.capacity) grow(written + 1);
+      dec_buf.data[written] = c;
+      written++;
     }
 
-    void reset_write_ptr() { curr_write = dec_buf->get(); }
+    void write(const char* buf, int n) override {
+      if (written + n > dec_buf.capacity) grow(written + n);
+      memcpy(dec_buf.data.get() + written, buf, n);
+      written += n;
+    }
+
+    void grow(long long min_capacity) {
+      const long long new_capacity = std::max(min_capacity, dec_buf.capacity * 2);
+      auto new_data = std::make_unique_for_overwrite<char[]>(new_capacity);
+      memcpy(new_data.get(), dec_buf.data.get(), written);
+      dec_buf.data = std::move(new_data);
+      dec_buf.capacity = new_capacity;
+    }
+
+    [[nodiscard]] long long written_amt() const { return written; }
   };
 
   class ZpaqIStreamBlockManager
   {
   public:
+    long long uncompressed_pos;  // where the block's data starts on the uncompressed stream
     ZpaqIStreamBufReader reader;
-    std::unique_ptr<char[]> dec_buf;
     ZpaqIStreamBufWriter writer;
-    std::thread decompression_thread;
+    std::promise<void> decompression_promise;
+    std::future<void> decompression_finished = decompression_promise.get_future();
 
-    explicit ZpaqIStreamBlockManager(std::vector<char>&& otf_in)
-      : reader(std::move(otf_in)), dec_buf(std::make_unique<char[]>(CHUNK * 10)), writer(&this->dec_buf) {}
+    ZpaqIStreamBlockManager(std::vector<char>&& otf_in, long long uncompressed_pos, ZpaqDecBuffer&& dec_buf)
+      : uncompressed_pos(uncompressed_pos), reader(std::move(otf_in)), writer(std::move(dec_buf)) {}
 
-    void decompress_on_thread()
+    void decompress_on_pool(ZpaqWorkerPool& worker_pool)
     {
-      decompression_thread = std::thread(&ZpaqIStreamBlockManager::decompress, this);
+      worker_pool.submit([this, &worker_pool](ZpaqWorkerPool::ZpaqWorkerContext& context) {
+        try {
+          decompress(context.decompresser, worker_pool.memory_budget);
+          decompression_promise.set_value();
+        }
+        catch (...) {
+          // Rethrown to the consumer once it gets to this block
+          context.reset();
+          decompression_promise.set_exception(std::current_exception());
+        }
+      });
     }
 
-    void decompress()
+    void decompress(libzpaq::Decompresser& decompresser, MemoryBudget& memory_budget)
     {
-      libzpaq::Decompresser decompresser;
       decompresser.setInput(&reader);
       decompresser.setOutput(&writer);
-      decompresser.findBlock();
+      double memory;  // bytes required to decompress, as the block header says which models it uses we know this before decompressing
+      decompresser.findBlock(&memory);
+      MemoryBudget::Reservation reservation(memory_budget, memory);
       decompresser.findFilename(); // This finds the segment
       decompresser.readComment();
       decompresser.decompress(-1);
       decompresser.readSegmentEnd();
+      decompresser.findFilename(); // Consume the end of block, leaving the worker's Decompresser ready for its next block
     }
   };
+  class ZpaqBlockIndexEntry
+  {
+  public:
+    long long header_pos;  // position of the block header on the wrapped istream
+    long long uncompressed_pos;
+    long long uncompressed_size;
+  };
 public:
   std::istream* wrapped_istream;
   bool owns_wrapped_istream = false;
-  std::unique_ptr<char[]> otf_dec;
-  ZpaqIStreamBufReader reader;
-  ZpaqIStreamBufWriter writer;
+  bool wrapped_istream_eof = false;
+  long long chunk_size;
   std::queue<std::unique_ptr<ZpaqIStreamBlockManager>> block_managers;
+  // The get area points straight into this block's dec_buf, its buffer goes back to free_dec_bufs once it has been consumed
+  std::unique_ptr<ZpaqIStreamBlockManager> current_block;
+  std::vector<ZpaqDecBuffer> free_dec_bufs;
   unsigned int max_thread_count;
-
-  ZpaqIStreamBuffer(std::unique_ptr<std::istream>&& wrapped_istream, unsigned int max_thread_count)
-    : reader(wrapped_istream.get()), writer(&this->otf_dec), max_thread_count(max_thread_count) {
+  // Position of the first block header on the wrapped istream, -1 if the wrapped istream can't seek (pipes), in which case neither can we
+  long long blocks_start_pos = -1;
+  std::vector<ZpaqBlockIndexEntry> block_index;
+  bool block_index_built = false;
+  long long get_area_pos = 0;  // uncompressed stream position of eback()
+  long long next_queued_pos = 0;  // uncompressed stream position where the next block to be queued starts
+  long long read_ahead_limit = -1;
+  // Might be shared with other streams, so we wait for our own pending tasks on destruction instead of relying on the pool doing so
+  std::shared_ptr<ZpaqWorkerPool> worker_pool;
+
+  // Unless given, as many blocks as the pool has threads are kept queued or being decompressed. Streams sharing a pool with many others
+  // might want less, as each block read ahead costs its compressed and decompressed buffers.
+  ZpaqIStreamBuffer(
+    std::unique_ptr<std::istream>&& wrapped_istream, std::shared_ptr<ZpaqWorkerPool> worker_pool, long long chunk_size, unsigned int read_ahead_blocks = 0
+  )
+    : chunk_size(chunk_size), max_thread_count(read_ahead_blocks > 0 ? read_ahead_blocks : worker_pool->thread_count()), worker_pool(std::move(worker_pool)) {
     this->wrapped_istream = wrapped_istream.release();
     owns_wrapped_istream = true;
     init();
   }
 
-  static std::unique_ptr<std::istream> from_istream(std::unique_ptr<std::istream>&& istream, unsigned int max_thread_count) {
+  ZpaqIStreamBuffer(std::unique_ptr<std::istream>&& wrapped_istream, unsigned int max_thread_count, long long chunk_size, double memory_limit = 0)
+    : ZpaqIStreamBuffer(std::move(wrapped_istream), std::make_shared<ZpaqWorkerPool>(max_thread_count, max_thread_count, memory_limit), chunk_size) {}
+
+  static std::unique_ptr<std::istream> from_istream(
+    std::unique_ptr<std::istream>&& istream, unsigned int max_thread_count, long long chunk_size, double memory_limit = 0
+  ) {
     auto new_fin = std::unique_ptr<std::istream>(new std::ifstream());
-    auto zpaq_streambuf = new ZpaqIStreamBuffer(std::move(istream), max_thread_count);
+    auto zpaq_streambuf = new ZpaqIStreamBuffer(std::move(istream), max_thread_count, chunk_size, memory_limit);
     new_fin->rdbuf(zpaq_streambuf);
     return new_fin;
   }
 
   void init() {
-    otf_dec = std::make_unique<char[]>(CHUNK * 10);
+    blocks_start_pos = wrapped_istream->tellg();
+
+    setg(nullptr, nullptr, nullptr);
+  }
 
-    setg(otf_dec.get(), otf_dec.get(), otf_dec.get());
+  // At most max_thread_count + 1 decompression buffers are ever allocated, as they are reused once each block is consumed.
+  // Buffers are sized for the block's uncompressed size, so memory usage follows the actual blocks and not the worst case.
+  ZpaqDecBuffer acquire_dec_buf(long long size) {
+    ZpaqDecBuffer dec_buf;
+    if (!free_dec_bufs.empty()) {
+      dec_buf = std::move(free_dec_bufs.back());
+      free_dec_bufs.pop_back();
+    }
+    if (dec_buf.capacity < size) {
+      dec_buf.data = nullptr;  // free the old allocation first so both are never alive at the same time
+      dec_buf.data = std::make_unique_for_overwrite<char[]>(size);
+      dec_buf.capacity = size;
+    }
+    return dec_buf;
+  }
+
+  void release_block(std::unique_ptr<ZpaqIStreamBlockManager>&& block_manager) {
+    if (block_manager == nullptr) return;
+    free_dec_bufs.emplace_back(std::move(block_manager->writer.dec_buf));
+    block_manager = nullptr;
   }
 
+  // Blocks starting at or after end_pos are not queued for decompression, so when only a range of the stream is needed
+  // the workers don't waste time decompressing past it. A negative end_pos removes the limit.
+  void limit_read_ahead(long long end_pos) { read_ahead_limit = end_pos; }
+
   ~ZpaqIStreamBuffer() override {
+    discard_queued_blocks();
     if (owns_wrapped_istream) delete wrapped_istream;
   }
 
-  static bool findBlock(libzpaq::Decompresser& zpaq_decompresser) {
-    bool found = true;
-    double memory;                         // bytes required to decompress
-    found &= zpaq_decompresser.findBlock(&memory);
-    if (!found) return found;
-    found &= zpaq_decompresser.findFilename(); // This finds the segment
-    if (!found) return found;
-    zpaq_decompresser.readComment();
-    return found;
+  // Make sure we have max_thread_count blocks queued or being decompressed at any time (unless EOF already reached).
+  // Thanks to the block headers we know exactly how much to read for each block, so they go straight to the workers without any parsing.
+  void queue_blocks() {
+    while (!wrapped_istream_eof && block_managers.size() < max_thread_count)
+    {
+      if (read_ahead_limit >= 0 && next_queued_pos >= read_ahead_limit) break;
+      ZpaqBlockHeader block_header{};
+      if (!read_block_header(*wrapped_istream, block_header) || block_header.compressed_size == 0) {
+        wrapped_istream_eof = true;
+        break;
+      }
+      std::vector<char> compressed_block(block_header.compressed_size);
+      wrapped_istream->read(compressed_block.data(), block_header.compressed_size);
+      if (wrapped_istream->gcount() != block_header.compressed_size) libzpaq::error("unexpected end of file");
+
+      const auto& manager = block_managers.emplace(new ZpaqIStreamBlockManager(
+        std::move(compressed_block), next_queued_pos, acquire_dec_buf(std::min(block_header.uncompressed_size, chunk_size))
+      ));
+      manager->decompress_on_pool(*worker_pool);
+      next_queued_pos += block_header.uncompressed_size;
+    }
+  }
+
+  // Hops through the block headers to get where each block is, only reading 8 bytes per block
+  bool build_block_index() {
+    if (block_index_built) return true;
+    if (blocks_start_pos < 0) return false;
+    wrapped_istream->clear();
+    const auto prev_pos = wrapped_istream->tellg();
+    wrapped_istream->seekg(blocks_start_pos);
+    long long uncompressed_pos = 0;
+    while (true) {
+      const long long header_pos = wrapped_istream->tellg();
+      ZpaqBlockHeader block_header{};
+      if (!read_block_header(*wrapped_istream, block_header) || block_header.compressed_size == 0) break;
+      block_index.push_back({ header_pos, uncompressed_pos, block_header.uncompressed_size });
+      uncompressed_pos += block_header.uncompressed_size;
+      wrapped_istream->seekg(block_header.compressed_size, std::ios_base::cur);
+    }
+    block_index.push_back({ -1, uncompressed_pos, 0 });  // sentinel for the end of the stream
+    block_index_built = true;
+    // Leave the wrapped istream where it was, so the blocks already queued continue to be read in order
+    wrapped_istream->clear();
+    wrapped_istream->seekg(prev_pos);
+    return true;
+  }
+
+  // Drops whatever was queued or already decompressed, the workers need to finish with the queued blocks as they reference them
+  void discard_queued_blocks() {
+    while (!block_managers.empty()) {
+      block_managers.front()->decompression_finished.wait();
+      release_block(std::move(block_managers.front()));
+      block_managers.pop();
+    }
+    release_block(std::move(current_block));
+    setg(nullptr, nullptr, nullptr);
+  }
+
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+    if (!(which & std::ios_base::in)) return pos_type(off_type(-1));
+    const long long curr_pos = get_area_pos + (gptr() - eback());
+    if (dir == std::ios_base::cur && off == 0) return curr_pos;  // tellg(), no need to go through the index
+    if (!build_block_index()) return pos_type(off_type(-1));
+
+    long long target_pos = off;
+    if (dir == std::ios_base::cur) target_pos += curr_pos;
+    else if (dir == std::ios_base::end) target_pos += block_index.back().uncompressed_pos;
+    return seekpos(target_pos, which);
+  }
+
+  // Only the block that has the target position is read and decompressed (and whatever is read ahead after it),
+  // any blocks before it are skipped using the block index
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+    if (!(which & std::ios_base::in)) return pos_type(off_type(-1));
+    const long long target_pos = pos;
+    if (target_pos >= get_area_pos && target_pos < get_area_pos + (egptr() - eback())) {
+      setg(eback(), eback() + (target_pos - get_area_pos), egptr());
+      return target_pos;
+    }
+    if (!build_block_index()) return pos_type(off_type(-1));
+    if (target_pos < 0 || target_pos > block_index.back().uncompressed_pos) return pos_type(off_type(-1));
+
+    // Last block with uncompressed_pos <= target_pos, or the end of stream sentinel
+    const auto block = std::prev(std::upper_bound(
+      block_index.begin(), block_index.end(), target_pos,
+      [](long long pos, const ZpaqBlockIndexEntry& entry) { return pos < entry.uncompressed_pos; }
+    ));
+    discard_queued_blocks();
+    get_area_pos = block->uncompressed_pos;
+    next_queued_pos = block->uncompressed_pos;
+    if (block->header_pos < 0) {
+      wrapped_istream_eof = true;
+      return target_pos;
+    }
+    wrapped_istream->clear();
+    wrapped_istream->seekg(block->header_pos);
+    wrapped_istream_eof = false;
+
+    if (underflow() == EOF) return pos_type(off_type(-1));
+    gbump(static_cast<int>(target_pos - get_area_pos));
+    return target_pos;
+  }
+
+  // Writes what's left of the current decompressed block (up to max_size bytes) to the ostream in one go, waiting for the next block if
+  // the current one was already consumed. Returns the amount written, 0 once the end of the stream is reached.
+  std::streamsize write_block_to(std::ostream& ostream, std::streamsize max_size) {
+    if (underflow() == EOF) return 0;
+    const auto amt = std::min<std::streamsize>(max_size, egptr() - gptr());
+    ostream.write(gptr(), amt);
+    gbump(static_cast<int>(amt));
+    return amt;
   }
 
   int underflow() override {
     if (gptr() < egptr())
-      return *gptr();
-
-    print_work_sign(true);
+      return static_cast<unsigned char>(*gptr());
+
+    get_area_pos += egptr() - eback();
+    long long amt_read = 0;
+    while (amt_read == 0) {
+      // The current block was fully consumed, so its buffer can be reused for one of the blocks we are about to queue
+      release_block(std::move(current_block));
+      queue_blocks();
+      if (block_managers.empty()) {
+        setg(nullptr, nullptr, nullptr);
+        return EOF;
+      }
 
-    // Make sure we have max_thread_count threads launched at any time (unless EOF already reached)
-    while (block_managers.size() < max_thread_count)
-    {
-      libzpaq::Decompresser zpaq_decompresser;
-      zpaq_decompresser.setInput(&reader);
-      zpaq_decompresser.setOutput(&writer);
-      const bool found = findBlock(zpaq_decompresser);
-      if (!found) break; // This should only happen if we are at the original istream EOF so there are no more blocks to decompress
-      zpaq_decompresser.readSegmentEnd();
-
-      auto full_compressed_block = reader.buffer_discard_old_data();
-      const auto& manager = block_managers.emplace(new ZpaqIStreamBlockManager(std::move(full_compressed_block)));
-      manager->decompress_on_thread();
-    }
-
-    // As we need more data, we will need to wait for and get the data for the thread processing the next block
-    const auto& front_block_manager = block_managers.front();
-    front_block_manager->decompression_thread.join();
-    int amt_read = front_block_manager->writer.curr_write - front_block_manager->writer.dec_buf->get();
-    for (long long slot = 0; slot < amt_read; slot++)
-    {
-      *(otf_dec.get() + slot) = *(front_block_manager->writer.dec_buf->get() + slot);
+      // As we need more data, we will need to wait for and get the data for the worker processing the next block
+      current_block = std::move(block_managers.front());
+      block_managers.pop();
+      current_block->decompression_finished.get();  // rethrows the worker's error if the block failed
+      amt_read = current_block->writer.written_amt();
+      get_area_pos = current_block->uncompressed_pos;
     }
-    block_managers.pop();
-    
-    setg(otf_dec.get(), otf_dec.get(), otf_dec.get() + amt_read);
-    if (amt_read == 0) return EOF;
-    writer.reset_write_ptr();
+
+    char* dec_buf = current_block->writer.dec_buf.data.get();
+    setg(dec_buf, dec_buf, dec_buf + amt_read);
     return static_cast<unsigned char>(*gptr());
   }
 };
 
-std::unique_ptr<std::istream> wrap_istream_otf_compression(std::unique_ptr<std::istream>&& istream, unsigned int max_thread_count);
+std::unique_ptr<std::istream> wrap_istream_otf_compression(
+  std::unique_ptr<std::istream>&& istream, unsigned int max_thread_count, long long chunk_size, double memory_limit = 0
+);
 
 class CompressedOStreamBuffer : public std::streambuf
 {
 public:
   std::unique_ptr<std::ostream> wrapped_ostream;
   bool is_stream_eof = false;
-  std::unique_ptr<char[]> otf_in;
-  std::unique_ptr<char[]> otf_out;
+  long long chunk_size;
 
-  explicit CompressedOStreamBuffer(std::unique_ptr<std::ostream>&& wrapped_ostream): wrapped_ostream(std::move(wrapped_ostream))
-  {
-    otf_in = std::make_unique<char[]>(CHUNK);
-    otf_out = std::make_unique<char[]>(CHUNK);
-    setp(otf_in.get(), otf_in.get() + CHUNK);
-  }
+  // Derived classes are responsible for setting up the put area (with setp()) where the data to be compressed gets written
+  CompressedOStreamBuffer(std::unique_ptr<std::ostream>&& wrapped_ostream, long long chunk_size)
+    : wrapped_ostream(std::move(wrapped_ostream)), chunk_size(chunk_size) {}
 
   virtual int sync(bool final_byte) = 0;
   int sync() override { return sync(false); }
 
+  // Compresses a block straight from the mapped file instead of from the put area, the file must be kept mapped until the stream is finished
+  virtual void compress_mapped_block(const MappedFile& file, long long offset, long long size) = 0;
+  // Compresses a block whose data the worker reads by itself from the file at the given offset, the file must be kept open until the stream is finished
+  virtual void compress_positional_block(const PositionalFile& file, long long offset, long long size) = 0;
+
+  // Might throw if the stream failed, but only the first time it's called
   void set_stream_eof() {
     if (is_stream_eof) return;
-    sync(true);
     is_stream_eof = true;
+    sync(true);
   }
 
   int overflow(int c) override {
@@ -255,152 +460,450 @@ public:
 
     return c;
   }
+
+  // Bulk writes are copied straight into the put area, instead of going through overflow() for each byte once it's full
+  std::streamsize xsputn(const char* s, std::streamsize n) override {
+    std::streamsize written = 0;
+    while (written < n) {
+      if (pptr() == epptr()) {
+        sync();
+      }
+      const auto amt = std::min<std::streamsize>(n - written, epptr() - pptr());
+      memcpy(pptr(), s + written, amt);
+      pbump(static_cast<int>(amt));
+      written += amt;
+    }
+    return written;
+  }
+
+  // Reads from the istream directly into the put area until it's full (or the istream is exhausted), so the data is read right where
+  // it's going to be compressed from without any intermediate copy. Returns the amount read, 0 once the istream is exhausted.
+  std::streamsize ingest(std::istream& istream) {
+    if (pptr() == epptr()) {
+      sync();
+    }
+    istream.read(pptr(), epptr() - pptr());
+    const auto amt = istream.gcount();
+    pbump(static_cast<int>(amt));
+    return amt;
+  }
+
+  // Same as above but for a file that is already in memory, which must stay mapped until the stream is finished.
+  // Only what's needed to complete a block already started on the put area is copied, whole blocks are compressed right from the mapping.
+  std::streamsize ingest(const MappedFile& file, long long offset, long long size);
+
+  // Same again for a file the workers can read from at any offset, so each of them reads its own block in parallel
+  std::streamsize ingest(const PositionalFile& file, long long offset, long long size);
+};
+
+// File opened for reading at arbitrary offsets without a shared file position, so any number of threads can read from it at the same time
+class PositionalFile
+{
+public:
+  // With drop_page_cache the OS is told to evict each block's data from the page cache once it was compressed
+  explicit PositionalFile(const std::string& filename, bool drop_page_cache = false);
+  ~PositionalFile();
+  PositionalFile(const PositionalFile&) = delete;
+  PositionalFile& operator=(const PositionalFile&) = delete;
+
+  [[nodiscard]] bool is_open() const;
+  [[nodiscard]] long long size() const { return file_size; }
+  // Returns the amount read, which is only less than size at the end of the file or on error
+  long long read_at(char* buf, long long size, long long offset) const;
+  // Called once we are done with a range of the file
+  void release_range(long long offset, long long size) const;
+
+private:
+#ifdef __unix
+  int fd = -1;
+#else
+  void* handle;
+#endif
+  long long file_size = 0;
+  bool drop_page_cache;
+};
+
+// Read only memory mapping of a whole file, so its data can be compressed straight from the page cache without being read through a stream.
+// Only available on Unix, elsewhere (or if mapping fails, i.e. empty files) data() is nullptr and the file needs to be read as usual.
+class MappedFile
+{
+public:
+  // With drop_page_cache the OS is told to evict each block's data from the page cache once it was compressed, not just unmap it
+  explicit MappedFile(const std::string& filename, bool drop_page_cache = false);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  [[nodiscard]] const char* data() const { return mapped_data; }
+  [[nodiscard]] long long size() const { return mapped_size; }
+
+  // Tell the OS we are done with this part of the mapping so it can drop its pages instead of keeping them around,
+  // pages that are only partially within the range are kept as their other part might still be needed
+  void release_range(long long offset, long long size) const;
+
+private:
+  const char* mapped_data = nullptr;
+  long long mapped_size = 0;
+#ifdef __unix
+  int fd = -1;
+#endif
+  bool drop_page_cache;
 };
 
 class ZpaqOStreamBuffer : public CompressedOStreamBuffer
 {
-  class ZpaqOStreamBufReader : public libzpaq::Reader
+  // Input and output buffers for a block, StringBuffer is both a libzpaq::Reader and Writer and what compressBlock takes, so no
+  // adapters are needed for either compression path
+  class ZpaqBlockBuffers
   {
   public:
-    std::unique_ptr<char[]> buffer;
-    char* curr_read = nullptr;
-    char* data_end;
-
-    explicit ZpaqOStreamBufReader(std::unique_ptr<char[]>* otf_in) {
-      buffer = std::make_unique<char[]>(CHUNK);
-      std::copy_n(otf_in->get(), CHUNK, buffer.get());
-      data_end = buffer.get() + CHUNK;
+    libzpaq::StringBuffer input;
+    libzpaq::StringBuffer output;
+
+    explicit ZpaqBlockBuffers(long long chunk_size) : input(chunk_size + 1), output(chunk_size + 1) {
+      // Allocate all the memory we are going to need upfront, StringBuffer allocates exactly its initial size + 1 on its first write if
+      // that's enough, and only frees memory on reset() or destruction
+      input.write(nullptr, chunk_size);
+      input.resize(0);
+      output.write(nullptr, chunk_size);
+      output.resize(0);
     }
 
+    char* put_area() { return reinterpret_cast<char*>(input.data()); }
+  };
+
+  class ZpaqMemoryReader : public libzpaq::Reader
+  {
+  public:
+    const char* data;
+    long long size;
+    long long pos = 0;
+
+    ZpaqMemoryReader(const char* data, long long size) : data(data), size(size) {}
+
+    int get() override { return pos < size ? static_cast<unsigned char>(data[pos++]) : EOF; }
+
     int read(char* buf, int n) override {
-      if (curr_read == nullptr) reset_read_ptr();
-      if (curr_read == data_end) return 0;
-      const auto remaining_data_size = data_end - curr_read;
-      auto read_size = remaining_data_size;
-      if (n < remaining_data_size) {
-        read_size = n;
-      }
-      memcpy(buf, curr_read, read_size);
-      curr_read += read_size;
+      const auto read_size = std::min<long long>(n, size - pos);
+      memcpy(buf, data + pos, read_size);
+      pos += read_size;
       return read_size;
     }
-
-    int get() override {
-      if (curr_read == nullptr) reset_read_ptr();
-      if (curr_read == data_end) return EOF;
-      const auto chr = static_cast<unsigned char>(*curr_read);
-      curr_read++;
-      return chr;
-    }
-
-    void reset_read_ptr() { curr_read = buffer.get(); }
   };
 
-  class ZpaqOStreamBufWriter : public libzpaq::Writer
+  // Ring of preallocated block buffers, the put area is always one of these and they get swapped with setp() on each sync(),
+  // so blocks move from the producer to the workers and then to the writer thread without copying or allocating
+  class ZpaqBlockBufferRing
   {
   public:
-    std::unique_ptr<char[]> buffer;
-    char* current_buffer_pos = nullptr;
-
-    ZpaqOStreamBufWriter()
-    {
-      buffer = std::make_unique<char[]>(2*CHUNK);
-      current_buffer_pos = buffer.get();
+    ZpaqBlockBufferRing(unsigned int buffer_count, long long chunk_size) {
+      for (unsigned int i = 0; i < buffer_count; i++) {
+        free_buffers.emplace_back(std::make_unique<ZpaqBlockBuffers>(chunk_size));
+      }
     }
 
-    void write(const char* buf, int n) override {
-      std::copy_n(buf, n, current_buffer_pos);
-      current_buffer_pos += n;
+    // Blocks until some buffers are released if all of them are in use
+    std::unique_ptr<ZpaqBlockBuffers> acquire() {
+      std::unique_lock lock(mtx);
+      buffers_released.wait(lock, [this]() { return !free_buffers.empty(); });
+      auto buffers = std::move(free_buffers.back());
+      free_buffers.pop_back();
+      return buffers;
     }
 
-    void put(int c) override {
-      *current_buffer_pos = c;
-      current_buffer_pos++;
+    void release(std::unique_ptr<ZpaqBlockBuffers>&& buffers) {
+      buffers->input.resize(0);
+      buffers->output.resize(0);
+      {
+        std::unique_lock lock(mtx);
+        free_buffers.emplace_back(std::move(buffers));
+      }
+      buffers_released.notify_one();
     }
 
-    [[nodiscard]] long long written_amt() const { return current_buffer_pos - buffer.get(); }
+  private:
+    std::vector<std::unique_ptr<ZpaqBlockBuffers>> free_buffers;
+    std::mutex mtx;
+    std::condition_variable buffers_released;
   };
 
   class ZpaqOstreamBlockManager
   {
   public:
-    libzpaq::Compressor compressor;
-    ZpaqOStreamBufReader reader;
-    ZpaqOStreamBufWriter writer;
-    std::thread compression_thread;
-    bool compression_finished = false;
-
-    explicit ZpaqOstreamBlockManager(std::unique_ptr<char[]>* otf_in) : reader(otf_in)
+    long long sequence;
+    long long uncompressed_size;
+    std::unique_ptr<ZpaqBlockBuffers> buffers;
+    // If not null the block's data is on this file at input_offset instead of on buffers->input, see compress_mapped_block()
+    const MappedFile* mapped_input = nullptr;
+    // If not null the block's data is to be read from this file at input_offset into buffers->input by the worker, see compress_positional_block()
+    const PositionalFile* positional_input = nullptr;
+    long long input_offset = 0;
+    // Set by the worker if compression failed, the writer stops the stream at this block
+    std::exception_ptr error;
+
+    ZpaqOstreamBlockManager(long long sequence, std::unique_ptr<ZpaqBlockBuffers>&& buffers, long long size)
+      : sequence(sequence), uncompressed_size(size), buffers(std::move(buffers))
     {
-      compressor.setInput(&reader);
-      compressor.setOutput(&writer);
+      // The data is already there as it was written on the put area, this just moves the StringBuffer's write pointer past it
+      this->buffers->input.write(nullptr, size);
     }
 
-    void compress_on_thread(const bool final_byte, long long size)
-    {
-      compression_thread = std::thread(&ZpaqOstreamBlockManager::compress, this, final_byte, size);
-    }
+    ZpaqOstreamBlockManager(long long sequence, std::unique_ptr<ZpaqBlockBuffers>&& buffers, long long size, const MappedFile& file, long long offset)
+      : sequence(sequence), uncompressed_size(size), buffers(std::move(buffers)), mapped_input(&file), input_offset(offset) {}
 
-    void compress(const bool final_byte, long long size)
+    ZpaqOstreamBlockManager(long long sequence, std::unique_ptr<ZpaqBlockBuffers>&& buffers, long long size, const PositionalFile& file, long long offset)
+      : sequence(sequence), uncompressed_size(size), buffers(std::move(buffers)), positional_input(&file), input_offset(offset) {}
+
+    void compress(ZpaqWorkerPool::ZpaqWorkerContext& context, const std::string& method)
     {
-      if (final_byte) {
-        reader.data_end = reader.buffer.get() + size;
+      auto& input = buffers->input;
+      auto& output = buffers->output;
+      if (positional_input != nullptr) {
+        if (positional_input->read_at(buffers->put_area(), uncompressed_size, input_offset) != uncompressed_size) {
+          libzpaq::error("can't read input file");
+        }
+        input.write(nullptr, uncompressed_size);
+      }
+      const char* external_input = mapped_input != nullptr ? mapped_input->data() + input_offset : nullptr;
+      // The built-in model and bare levels adapt to each block's data, explicit "LB,R,t" or config methods are used as given.
+      // Incompressible blocks are stored, which both compresses and decompresses at memcpy speed instead of going through the models.
+      // The built-in model first makes sure there are no long range repeats the statistics missed, as its match model would find those,
+      // bare levels would store the block on their own anyway.
+      // A bare level gets the rest of "LB,R,t" from the block, so compressBlock picks LZ77, BWT or CM for it.
+      std::string block_method = method;
+      if (method.empty() || BlockAnalysis::is_bare_level(method)) {
+        const auto* data = external_input != nullptr ? reinterpret_cast<const unsigned char*>(external_input) : input.data();
+        const BlockAnalysis analysis(data, uncompressed_size);
+        if (analysis.is_incompressible() && (!method.empty() || !BlockAnalysis::has_long_range_repeats(data, uncompressed_size))) {
+          block_method = "0";
+        }
+        else if (!method.empty()) block_method = analysis.complete_method(method);
+      }
+      if (block_method.empty()) {
+        ZpaqMemoryReader external_reader(external_input, uncompressed_size);
+        auto& compressor = context.compressor;
+        if (external_input != nullptr) compressor.setInput(&external_reader);
+        else compressor.setInput(&input);
+        compressor.setOutput(&output);
+        compressor.writeTag();
+        compressor.startBlock(2);
+        compressor.startSegment();
+        compressor.compress(uncompressed_size);
+        compressor.endSegment();
+        compressor.endBlock();
+      }
+      else {
+        // compressBlock takes a StringBuffer it is allowed to modify, so external data does need to be copied here
+        if (external_input != nullptr) input.write(external_input, uncompressed_size);
+        // compressBlock takes care of expanding the method and running the LZ77/BWT/E8E9 preprocessing that goes with it, which might
+        // modify the input in place, that's fine as it's not needed afterwards.
+        // No SHA1 as our Decompresser::readSegmentEnd doesn't handle it.
+        libzpaq::compressBlock(&input, &output, block_method.c_str(), nullptr, nullptr, false);
       }
-
-      compressor.writeTag();
-      compressor.startBlock(2);
-      compressor.startSegment();
-      compressor.compress(CHUNK);
-      compressor.endSegment();
-      compressor.endBlock();
-      reader.reset_read_ptr();
-      compression_finished = true;
     }
 
     void write_to_ostream(std::ostream& ostream) const
     {
-      ostream.write(writer.buffer.get(), writer.written_amt());
+      write_block_header(ostream, { static_cast<long long>(buffers->output.size()), uncompressed_size });
+      ostream.write(buffers->output.c_str(), buffers->output.size());
     }
   };
 public:
-  std::queue<std::unique_ptr<ZpaqOstreamBlockManager>> block_managers;
   unsigned int max_thread_count;
+  // libzpaq method string (as in "LB,R,t" or "x..."/"s..." configs) used for each block, if empty the built-in level 2 model is used
+  std::string method;
+  // Max amount of blocks handed to the workers but not yet written, finished blocks wait on the reorder buffer until all blocks before
+  // them are written, so a slow block only stalls the input once this many blocks are queued behind it
+  unsigned int reorder_window;
+  long long next_block_sequence = 0;
+  long long next_queued_sequence = 0;
+  long long blocks_written = 0;
+  // Reorder buffer, blocks that finished compressing, keyed by sequence, waiting for the blocks before them to finish
+  std::map<long long, std::unique_ptr<ZpaqOstreamBlockManager>> finished_blocks;
+  std::mutex finished_blocks_mtx;
+  std::condition_variable block_written;
+  // In sequence blocks waiting to be written by writer_thread, a nullptr signals the end of the stream.
+  // Workers are the producers for this queue, but only ever push while holding finished_blocks_mtx, so there is only one at a time.
+  SpscQueue<std::unique_ptr<ZpaqOstreamBlockManager>> write_queue;
+  std::thread writer_thread;
+  // One set of buffers for each block that can be pending on the reorder window, plus the one in use as the put area
+  ZpaqBlockBufferRing buffer_ring;
+  std::unique_ptr<ZpaqBlockBuffers> curr_buffers;
+  // Estimated memory needed to compress each block, reserved on the worker pool's memory budget while compressing it.
+  // Left at 0 if the budget has no limit, as nothing would be reserved anyway.
+  double block_memory = 0;
+  // First error of any block (or of writing to the wrapped ostream), only set by writer_thread while holding finished_blocks_mtx.
+  // Nothing else is written once it's set, and it's rethrown to the producer the next time it hands over a block.
+  std::exception_ptr stream_error;
+  // Might be shared with other streams, finish_writing() waits for our own pending tasks instead of relying on the pool doing so
+  std::shared_ptr<ZpaqWorkerPool> worker_pool;
+
+  // Unless given, the reorder window is sized for the pool's thread count. Streams sharing a pool with many others might want a smaller
+  // one, as each block in it costs a set of buffers.
+  ZpaqOStreamBuffer(
+    std::unique_ptr<std::ostream>&& wrapped_ostream, std::shared_ptr<ZpaqWorkerPool> worker_pool, long long chunk_size, std::string method,
+    unsigned int max_pending_blocks = 0
+  )
+    : CompressedOStreamBuffer(std::move(wrapped_ostream), chunk_size), max_thread_count(worker_pool->thread_count()), method(std::move(method)),
+      reorder_window(max_pending_blocks > 0 ? max_pending_blocks : max_thread_count * 2), write_queue(reorder_window), buffer_ring(reorder_window + 1, chunk_size),
+      worker_pool(std::move(worker_pool)) {
+    if (this->worker_pool->memory_budget.has_limit()) {
+      block_memory = this->worker_pool->memory_budget.block_estimate(this->method, chunk_size, [this, chunk_size]() {
+        return estimate_block_memory(this->method, chunk_size);
+      });
+    }
+    curr_buffers = buffer_ring.acquire();
+    setp(curr_buffers->put_area(), curr_buffers->put_area() + chunk_size);
+    writer_thread = std::thread(&ZpaqOStreamBuffer::write_blocks_to_ostream, this);
+  }
+
+  ZpaqOStreamBuffer(
+    std::unique_ptr<std::ostream>&& wrapped_ostream, unsigned int max_thread_count, long long chunk_size, std::string method, double memory_limit = 0
+  )
+    : ZpaqOStreamBuffer(
+        std::move(wrapped_ostream), std::make_shared<ZpaqWorkerPool>(max_thread_count, max_thread_count, memory_limit), chunk_size, std::move(method)
+      ) {}
 
-  ZpaqOStreamBuffer(std::unique_ptr<std::ostream>&& wrapped_ostream, unsigned int max_thread_count)
-    : CompressedOStreamBuffer(std::move(wrapped_ostream)), max_thread_count(max_thread_count) { }
+  ~ZpaqOStreamBuffer() override {
+    if (writer_thread.joinable()) finish_writing();
+  }
 
-  static std::unique_ptr<std::ostream> from_ostream(std::unique_ptr<std::ostream>&& ostream, unsigned int max_thread_count);
+  static std::unique_ptr<std::ostream> from_ostream(
+    std::unique_ptr<std::ostream>&& ostream, unsigned int max_thread_count, long long chunk_size, const std::string& method, double memory_limit = 0
+  );
 
-  void write_blocks_finished_compressing(bool final_byte)
+  // Memory the models of a block of chunk_size compressed with method take, plus compressBlock's LZ77/BWT preprocessing buffers.
+  // Worked out from the block header the method generates, without compressing anything.
+  // A bare level picks its models from each block's data, so any of the ones it picks from might be needed.
+  static double estimate_block_memory(const std::string& method, long long chunk_size);
+
+  void compress_on_pool(std::unique_ptr<ZpaqOstreamBlockManager>&& manager)
   {
-    while (!block_managers.empty())
-    {
-      const auto& manager = block_managers.front();
-      if (!manager->compression_finished && !final_byte && block_managers.size() != max_thread_count)
+    // std::function needs to be copyable so we can't capture the unique_ptr, ownership is taken back as soon as compression finishes
+    worker_pool->submit([this, manager = manager.release()](ZpaqWorkerPool::ZpaqWorkerContext& context) {
+      try {
+        MemoryBudget::Reservation reservation(worker_pool->memory_budget, block_memory);
+        manager->compress(context, method);
+      }
+      catch (...) {
+        // The block still goes through the reorder buffer, so the blocks after it don't wait for it forever
+        context.reset();
+        manager->error = std::current_exception();
+      }
+      if (manager->mapped_input != nullptr) manager->mapped_input->release_range(manager->input_offset, manager->uncompressed_size);
+      if (manager->positional_input != nullptr) manager->positional_input->release_range(manager->input_offset, manager->uncompressed_size);
+
+      std::unique_lock lock(finished_blocks_mtx);
+      finished_blocks.emplace(manager->sequence, manager);
+      // Hand over to the writer every block that is now in sequence, the reorder window ensures the queue has room for all of them
+      for (auto next_block = finished_blocks.find(next_queued_sequence); next_block != finished_blocks.end(); next_block = finished_blocks.find(next_queued_sequence)) {
+        write_queue.push(std::move(next_block->second));
+        finished_blocks.erase(next_block);
+        next_queued_sequence++;
+      }
+    });
+  }
+
+  // Runs on writer_thread, so a slow or blocked ostream doesn't stop the producer from taking more input
+  void write_blocks_to_ostream()
+  {
+    while (true) {
+      auto manager = write_queue.pop();
+      if (manager == nullptr) {
+        if (stream_error == nullptr) {
+          write_block_header(*this->wrapped_ostream, { 0, 0 });  // end of stream
+          // Buffered (or still in flight, for async file output) writes can fail too, and nothing after us would notice
+          this->wrapped_ostream->flush();
+          if (this->wrapped_ostream->fail()) set_stream_error(std::make_exception_ptr(std::runtime_error("can't write output")));
+        }
+        return;
+      }
+      // Once a block failed nothing else is written, the stream couldn't be decompressed past it anyway
+      if (stream_error == nullptr) {
+        if (manager->error != nullptr) {
+          set_stream_error(manager->error);
+        }
+        else {
+          manager->write_to_ostream(*this->wrapped_ostream);
+          if (this->wrapped_ostream->fail()) set_stream_error(std::make_exception_ptr(std::runtime_error("can't write output")));
+        }
+      }
+      buffer_ring.release(std::move(manager->buffers));
       {
-        // If we are at the final byte of the stream we want to wait and dump everything to the ostream (as this function won't be called again),
-        // and if we are already at the max_thread_count we want to wait until at least a thread slot is emptied, so we never go over that thread count.
-        // In any other case, we break out of here, postponing the dumping to ostream, and allow the threads to continue running.
-        break;
+        std::unique_lock lock(finished_blocks_mtx);
+        blocks_written++;
       }
-      manager->compression_thread.join();
-      manager->write_to_ostream(*this->wrapped_ostream);
-      block_managers.pop();
+      block_written.notify_all();
     }
   }
 
-  int sync(bool final_byte) override {
-    const auto& manager = block_managers.emplace(new ZpaqOstreamBlockManager(&this->otf_in));
-    manager->compress_on_thread(final_byte, pptr() - pbase());
-    write_blocks_finished_compressing(final_byte); // dump to the ostream any finished blocks
+  void set_stream_error(std::exception_ptr error)
+  {
+    std::unique_lock lock(finished_blocks_mtx);
+    stream_error = std::move(error);
+  }
+
+  // If the reorder window is full we want to wait until at least the next block in sequence is written, so we never go over it
+  void wait_for_reorder_window()
+  {
+    std::unique_lock lock(finished_blocks_mtx);
+    block_written.wait(lock, [this]() { return next_block_sequence - blocks_written < reorder_window; });
+    if (stream_error != nullptr) std::rethrow_exception(stream_error);
+  }
+
+  // Wait until every block is written and stop writer_thread, as it is the last block anybody could have pushed to write_queue we can
+  // safely push the end of stream signal from here. Doesn't throw, as it's also used on destruction.
+  void finish_writing()
+  {
+    {
+      std::unique_lock lock(finished_blocks_mtx);
+      block_written.wait(lock, [this]() { return blocks_written == next_block_sequence; });
+    }
+    write_queue.push(nullptr);
+    writer_thread.join();
+  }
 
-    setp(otf_in.get(), otf_in.get() + CHUNK);
+  void queue_block(std::unique_ptr<ZpaqOstreamBlockManager>&& manager) {
+    compress_on_pool(std::move(manager));
+    std::unique_lock lock(finished_blocks_mtx);
+    next_block_sequence++;
+  }
+
+  void compress_mapped_block(const MappedFile& file, long long offset, long long size) override {
+    // Only the output buffer is used for these, but we still take a whole set from the ring, so mapped blocks are bounded by the
+    // reorder window the same as any other block
+    queue_block(std::make_unique<ZpaqOstreamBlockManager>(next_block_sequence, buffer_ring.acquire(), size, file, offset));
+    wait_for_reorder_window();
+  }
+
+  void compress_positional_block(const PositionalFile& file, long long offset, long long size) override {
+    queue_block(std::make_unique<ZpaqOstreamBlockManager>(next_block_sequence, buffer_ring.acquire(), size, file, offset));
+    wait_for_reorder_window();
+  }
+
+  int sync(bool final_byte) override {
+    if (pptr() > pbase()) {
+      // Hand the put area buffers over to the block as they are, we get a new set from the ring below
+      queue_block(std::make_unique<ZpaqOstreamBlockManager>(next_block_sequence, std::move(curr_buffers), pptr() - pbase()));
+      curr_buffers = buffer_ring.acquire();
+      setp(curr_buffers->put_area(), curr_buffers->put_area() + chunk_size);
+    }
+    if (final_byte) {
+      finish_writing();  // dump everything to the ostream, as no more blocks are coming
+      if (stream_error != nullptr) std::rethrow_exception(stream_error);
+    }
+    else {
+      wait_for_reorder_window();
+    }
     return 0;
   }
 };
 
 std::unique_ptr<std::ostream> wrap_ostream_otf_compression(
   std::unique_ptr<std::ostream>&& ostream,
-  unsigned int compression_otf_thread_count
+  unsigned int compression_otf_thread_count,
+  long long chunk_size,
+  const std::string& method,
+  double memory_limit = 0
 );
 #endif // PZPIPE_IO_H
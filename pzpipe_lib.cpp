@@ -0,0 +1,49 @@
+#include "pzpipe_lib.h"
+
+ZpaqStreamCompressor::ZpaqStreamCompressor(
+  std::unique_ptr<std::ostream>&& output, std::shared_ptr<ZpaqWorkerPool> worker_pool, long long chunk_size, const std::string& method
+) {
+  // Before anything is allocated for chunks of that size
+  validate_compression_settings(method, chunk_size);
+  streambuf = std::make_unique<ZpaqOStreamBuffer>(std::move(output), std::move(worker_pool), chunk_size, method);
+}
+
+ZpaqStreamCompressor::~ZpaqStreamCompressor() {
+  try {
+    streambuf->set_stream_eof();
+  }
+  catch (...) {}
+}
+
+void ZpaqStreamCompressor::push(const char* data, long long size) {
+  while (size > 0) {
+    // Through sputn so the data is copied straight into the put area, in chunks that fit an std::streamsize on any platform
+    const auto amt = streambuf->sputn(data, std::min<long long>(size, streambuf->chunk_size));
+    data += amt;
+    size -= amt;
+  }
+}
+
+void ZpaqStreamCompressor::finish() {
+  streambuf->set_stream_eof();
+  streambuf->wrapped_ostream->flush();
+  if (streambuf->wrapped_ostream->fail()) throw std::runtime_error("can't write output");
+}
+
+ZpaqStreamDecompressor::ZpaqStreamDecompressor(
+  std::unique_ptr<std::istream>&& input, std::shared_ptr<ZpaqWorkerPool> worker_pool, long long chunk_size
+) : streambuf(std::make_unique<ZpaqIStreamBuffer>(std::move(input), std::move(worker_pool), chunk_size)) {}
+
+long long ZpaqStreamDecompressor::pull(char* buf, long long size) {
+  long long amt_read = 0;
+  while (amt_read < size) {
+    const auto amt = streambuf->sgetn(buf + amt_read, std::min<long long>(size - amt_read, streambuf->chunk_size));
+    if (amt == 0) break;
+    amt_read += amt;
+  }
+  return amt_read;
+}
+
+bool ZpaqStreamDecompressor::seek(long long pos) {
+  return streambuf->pubseekpos(pos, std::ios_base::in) == pos;
+}
@@ -0,0 +1,61 @@
+#ifndef PZPIPE_LIB_H
+#define PZPIPE_LIB_H
+#include "pzpipe_io.h"
+
+#include <memory>
+#include <istream>
+#include <ostream>
+#include <string>
+
+// Entry points for embedding pzpipe's multithreaded (de)compression in other programs. Nothing in here exits or prints, errors
+// (libzpaq's included, like corrupt input or an invalid method) are thrown as std::runtime_error to the thread using the stream,
+// even if a worker thread is the one that hit them.
+// Any number of compressors and decompressors can share a ZpaqWorkerPool, std::make_shared<ZpaqWorkerPool>(threads, threads, memory_limit),
+// so many streams in one process don't each spin up their own threads.
+// The streams are the raw block streams (a ZPAQ block preceded by a block header each), without the header the pzpipe CLI adds.
+
+// The caller pushes the data to compress, blocks are written to the ostream in order as soon as they are done
+class ZpaqStreamCompressor
+{
+public:
+  // An empty method uses the built-in level 2 model, see ZpaqOStreamBuffer::method.
+  // Throws std::runtime_error if the chunk size or method are invalid, see validate_compression_settings()
+  ZpaqStreamCompressor(
+    std::unique_ptr<std::ostream>&& output, std::shared_ptr<ZpaqWorkerPool> worker_pool, long long chunk_size = DEFAULT_CHUNK_SIZE,
+    const std::string& method = ""
+  );
+  // Unless finish() was called, what was pushed so far is still compressed and written, but errors are not reported
+  ~ZpaqStreamCompressor();
+  ZpaqStreamCompressor(const ZpaqStreamCompressor&) = delete;
+  ZpaqStreamCompressor& operator=(const ZpaqStreamCompressor&) = delete;
+
+  // Blocks the caller if the workers are behind
+  void push(const char* data, long long size);
+  // Compresses what's left and writes the end of the stream, once this returns the output has everything
+  void finish();
+  [[nodiscard]] std::ostream& output() const { return *streambuf->wrapped_ostream; }
+
+private:
+  std::unique_ptr<ZpaqOStreamBuffer> streambuf;
+};
+
+// The caller pulls the decompressed data, the blocks after the one being pulled from are decompressed ahead
+class ZpaqStreamDecompressor
+{
+public:
+  // chunk_size is only a hint for sizing the decompression buffers, blocks of any size can be decompressed
+  ZpaqStreamDecompressor(
+    std::unique_ptr<std::istream>&& input, std::shared_ptr<ZpaqWorkerPool> worker_pool, long long chunk_size = DEFAULT_CHUNK_SIZE
+  );
+  ZpaqStreamDecompressor(const ZpaqStreamDecompressor&) = delete;
+  ZpaqStreamDecompressor& operator=(const ZpaqStreamDecompressor&) = delete;
+
+  // Returns the amount copied to buf, which is only less than size at the end of the stream
+  long long pull(char* buf, long long size);
+  // Only possible if the input can seek, returns false otherwise or if pos is past the end of the stream
+  bool seek(long long pos);
+
+private:
+  std::unique_ptr<ZpaqIStreamBuffer> streambuf;
+};
+#endif // PZPIPE_LIB_H
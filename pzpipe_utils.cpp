@@ -65,6 +65,18 @@ void error(int error_nr, std::string tmp_filename) {
   case ERR_ONLY_SET_ZPAQ_THREAD_ONCE:
     print_to_console("ZPAQ thread count can only be set once");
     break;
+  case ERR_ONLY_SET_CHUNK_SIZE_ONCE:
+    print_to_console("Chunk size can only be set once");
+    break;
+  case ERR_ONLY_SET_METHOD_ONCE:
+    print_to_console("Compression method can only be set once");
+    break;
+  case ERR_ONLY_SET_RANGE_ONCE:
+    print_to_console("Decompression range can only be set once");
+    break;
+  case ERR_ONLY_SET_MEM_LIMIT_ONCE:
+    print_to_console("Memory limit can only be set once");
+    break;
   default:
     print_to_console("Unknown error");
   }
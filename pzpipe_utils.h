@@ -32,6 +32,10 @@ constexpr auto ERR_MORE_THAN_ONE_OUTPUT_FILE = 11;
 constexpr auto ERR_MORE_THAN_ONE_INPUT_FILE = 12;
 constexpr auto ERR_CTRL_C = 13;
 constexpr auto ERR_ONLY_SET_ZPAQ_THREAD_ONCE = 17;
+constexpr auto ERR_ONLY_SET_CHUNK_SIZE_ONCE = 18;
+constexpr auto ERR_ONLY_SET_METHOD_ONCE = 19;
+constexpr auto ERR_ONLY_SET_RANGE_ONCE = 20;
+constexpr auto ERR_ONLY_SET_MEM_LIMIT_ONCE = 21;
 
 void error(int error_nr, std::string tmp_filename = "");
 
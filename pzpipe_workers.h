@@ -0,0 +1,213 @@
+#ifndef PZPIPE_WORKERS_H
+#define PZPIPE_WORKERS_H
+#include "contrib/zpaq/libzpaq.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Caps the summed memory estimate of the blocks being (de)compressed at any time, a block that doesn't fit waits until enough memory
+// is released by the blocks before it. A block is always admitted if nothing else is running, even if it goes over the limit by itself,
+// so a limit smaller than a single block just serializes the work instead of stalling it.
+// Only the blocks' model memory goes through here, the streams' block buffers are allocated up front and aren't counted.
+class MemoryBudget
+{
+public:
+  // A limit of 0 or less means no limit
+  explicit MemoryBudget(double limit) : limit(limit) {}
+
+  void acquire(double amount) {
+    if (limit <= 0) return;
+    std::unique_lock lock(mtx);
+    memory_released.wait(lock, [this, amount]() { return in_use == 0 || in_use + amount <= limit; });
+    in_use += amount;
+  }
+
+  void release(double amount) {
+    if (limit <= 0) return;
+    {
+      std::unique_lock lock(mtx);
+      in_use -= amount;
+    }
+    memory_released.notify_all();
+  }
+
+  [[nodiscard]] bool has_limit() const { return limit > 0; }
+
+  // A block's memory estimate only depends on the method and chunk size, so it's worked out once for all the streams sharing the budget
+  // (like each file of a batch), compute is only called the first time a combination is seen
+  double block_estimate(const std::string& method, long long chunk_size, const std::function<double()>& compute) {
+    std::unique_lock lock(estimates_mtx);
+    const auto key = std::make_pair(method, chunk_size);
+    const auto estimate = block_estimates.find(key);
+    if (estimate != block_estimates.end()) return estimate->second;
+    return block_estimates.emplace(key, compute()).first->second;
+  }
+
+  // Acquires the amount until it goes out of scope, so it's released even if the block's (de)compression throws
+  class Reservation
+  {
+  public:
+    Reservation(MemoryBudget& budget, double amount) : budget(budget), amount(amount) { budget.acquire(amount); }
+    ~Reservation() { budget.release(amount); }
+    Reservation(const Reservation&) = delete;
+    Reservation& operator=(const Reservation&) = delete;
+
+  private:
+    MemoryBudget& budget;
+    double amount;
+  };
+
+private:
+  double limit;
+  double in_use = 0;
+  std::mutex mtx;
+  std::condition_variable memory_released;
+  std::map<std::pair<std::string, long long>, double> block_estimates;
+  std::mutex estimates_mtx;
+};
+
+// Fixed set of worker threads that live as long as the pool, blocks to (de)compress are handed to them through a bounded queue.
+// Each worker owns a ZpaqWorkerContext that is kept around between blocks, so the libzpaq model objects don't need to be
+// constructed again for every block.
+// A pool can be shared by any number of streams (see ZpaqOStreamBuffer and ZpaqIStreamBuffer), they all compete for the same threads
+// and memory budget. Tasks must not let exceptions escape, each stream hands its blocks' errors back to its own caller.
+class ZpaqWorkerPool
+{
+public:
+  class ZpaqWorkerContext
+  {
+  public:
+    libzpaq::Compressor compressor;
+    libzpaq::Decompresser decompresser;
+
+    // A block that failed leaves the models halfway through it, so they are recreated before the worker takes its next block
+    void reset() {
+      std::destroy_at(&compressor);
+      std::construct_at(&compressor);
+      std::destroy_at(&decompresser);
+      std::construct_at(&decompresser);
+    }
+  };
+  using Task = std::function<void(ZpaqWorkerContext&)>;
+
+  ZpaqWorkerPool(unsigned int thread_count, unsigned int queue_capacity, double memory_limit = 0)
+    : memory_budget(memory_limit), queue_capacity(std::max<unsigned int>(queue_capacity, 1))
+  {
+    thread_count = std::max<unsigned int>(thread_count, 1);
+    for (unsigned int i = 0; i < thread_count; i++) {
+      contexts.emplace_back(std::make_unique<ZpaqWorkerContext>());
+    }
+    for (unsigned int i = 0; i < thread_count; i++) {
+      workers.emplace_back(&ZpaqWorkerPool::worker_loop, this, contexts[i].get());
+    }
+  }
+
+  ZpaqWorkerPool(const ZpaqWorkerPool&) = delete;
+  ZpaqWorkerPool& operator=(const ZpaqWorkerPool&) = delete;
+
+  // Tasks already queued are still run before the workers are joined
+  ~ZpaqWorkerPool() {
+    {
+      std::unique_lock lock(mtx);
+      stopping = true;
+    }
+    queue_not_empty.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  }
+
+  // Blocks the caller while the queue is full, so a fast producer can't pile up an unbounded amount of pending blocks
+  void submit(Task&& task) {
+    {
+      std::unique_lock lock(mtx);
+      queue_not_full.wait(lock, [this]() { return tasks.size() < queue_capacity; });
+      tasks.emplace(std::move(task));
+    }
+    queue_not_empty.notify_one();
+  }
+
+  [[nodiscard]] unsigned int thread_count() const { return workers.size(); }
+
+  // Tasks reserve their block's estimated memory usage here before starting the heavy work, and release it when they are done
+  MemoryBudget memory_budget;
+
+private:
+  std::vector<std::unique_ptr<ZpaqWorkerContext>> contexts;
+  std::vector<std::thread> workers;
+  std::queue<Task> tasks;
+  unsigned int queue_capacity;
+  bool stopping = false;
+  std::mutex mtx;
+  std::condition_variable queue_not_empty;
+  std::condition_variable queue_not_full;
+
+  void worker_loop(ZpaqWorkerContext* context) {
+    while (true) {
+      Task task;
+      {
+        std::unique_lock lock(mtx);
+        queue_not_empty.wait(lock, [this]() { return stopping || !tasks.empty(); });
+        if (tasks.empty()) return;  // only possible if stopping
+        task = std::move(tasks.front());
+        tasks.pop();
+      }
+      queue_not_full.notify_one();
+      task(*context);
+    }
+  }
+};
+// Bounded single producer/single consumer queue to move items between two pipeline stages without locking.
+// Head and tail are ever increasing counters, a stage that has to wait for room or for an item sleeps on the other stage's counter.
+template <typename T>
+class SpscQueue
+{
+public:
+  explicit SpscQueue(size_t capacity) : slots(std::max<size_t>(capacity, 1)) {}
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  // Only to be called from the producer stage, blocks while the queue is full
+  void push(T&& item) {
+    const size_t curr_tail = tail.load(std::memory_order_relaxed);
+    size_t curr_head = head.load(std::memory_order_acquire);
+    while (curr_tail - curr_head == slots.size()) {
+      head.wait(curr_head, std::memory_order_acquire);
+      curr_head = head.load(std::memory_order_acquire);
+    }
+    slots[curr_tail % slots.size()] = std::move(item);
+    tail.store(curr_tail + 1, std::memory_order_release);
+    tail.notify_one();
+  }
+
+  // Only to be called from the consumer stage, blocks while the queue is empty
+  T pop() {
+    const size_t curr_head = head.load(std::memory_order_relaxed);
+    size_t curr_tail = tail.load(std::memory_order_acquire);
+    while (curr_tail == curr_head) {
+      tail.wait(curr_tail, std::memory_order_acquire);
+      curr_tail = tail.load(std::memory_order_acquire);
+    }
+    T item = std::move(slots[curr_head % slots.size()]);
+    head.store(curr_head + 1, std::memory_order_release);
+    head.notify_one();
+    return item;
+  }
+
+private:
+  std::vector<T> slots;
+  std::atomic<size_t> head = 0;  // next slot to pop, only advanced by the consumer
+  std::atomic<size_t> tail = 0;  // next slot to push, only advanced by the producer
+};
+#endif // PZPIPE_WORKERS_H